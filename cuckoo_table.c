@@ -0,0 +1,567 @@
+// ============================================
+// The cuckoo hashing engine file
+//
+// Copyright 2023 Georgia Tech. All rights reserved.
+// The materials provided by the instructor in this course are for
+// the use of the students currently enrolled in the course.
+// Copyrighted course materials may not be further disseminated.
+// This file must NOT be made publicly available anywhere.
+//==================================================================
+
+/****************************************************************************
+ * Bucketized cuckoo hashing
+ *
+ * Every key can live in exactly two buckets, derived from two independent hash
+ * functions, and every bucket holds four items in a single cache line. A
+ * lookup therefore reads at most two cache lines, however full the table is.
+ *
+ * An insert into two full buckets searches breadth-first for the shortest
+ * chain of items that can each move to their other bucket, ending in a bucket
+ * with a free slot, and shifts the items along it. Only when no such chain of
+ * bounded length exists does the table double in size. With four slots per
+ * bucket this keeps the load factor above 90% before the table has to grow.
+ *
+ * While a scan is in progress items must stay in their bucket, so inserts do
+ * not move other items and grow the table instead when both buckets are full.
+ * Growing only ever splits a bucket into the two that extend its low bits.
+ ***************************************************************************/
+#include "cuckoo_table.h"
+
+#include <stdint.h> // For uintptr_t
+#include <stdlib.h> // For free
+#include <string.h> // For memset and memcpy
+
+/****************************************************************************
+ * Hidden Definitions
+ ***************************************************************************/
+#define SLOTS_PER_BUCKET 4
+
+#define CACHE_LINE_SIZE 64
+
+/** The number of buckets the breadth-first search may look at per insert */
+#define MAX_SEARCH_NODES 512
+
+/** The number of items that one insert may move */
+#define MAX_PATH_LENGTH 5
+
+/** Seeds for the two hash functions */
+#define SEED_PRIMARY 0x9e3779b9u
+#define SEED_ALTERNATE 0x85ebca6bu
+
+/**
+ * This structure represents one bucket, which fills exactly one cache line.
+ */
+typedef struct _CuckooBucket
+{
+    /** The keys of the items in the bucket */
+    _Alignas(CACHE_LINE_SIZE) unsigned int keys[SLOTS_PER_BUCKET];
+
+    /** Bit i is set when slot i holds an item */
+    unsigned int occupied;
+
+    /** The values of the items in the bucket */
+    void *values[SLOTS_PER_BUCKET];
+} CuckooBucket;
+
+_Static_assert(sizeof(CuckooBucket) == CACHE_LINE_SIZE, "a bucket must fill one cache line");
+
+/**
+ * This structure represents a cuckoo table.
+ */
+struct _CuckooTable
+{
+    /** The buckets, aligned to a cache line */
+    CuckooBucket *buckets;
+
+    /** The number of buckets minus one. The number of buckets is a power of two */
+    unsigned int mask;
+
+    /** The block returned by the allocator for the buckets, and its size */
+    void *raw_buckets;
+    size_t raw_size;
+
+    /** The number of scans started and not yet completed */
+    unsigned int active_scans;
+
+    /** The allocator used for the table and its buckets */
+    HashTableAllocator allocator;
+};
+
+/**
+ * A node of the breadth-first search for a displacement path. The item in
+ * slot of the parent bucket can move into this bucket.
+ */
+typedef struct _SearchNode
+{
+    unsigned int bucket;
+    int parent;
+    unsigned int slot;
+} SearchNode;
+
+/****************************************************************************
+ * Private Functions
+ ***************************************************************************/
+/**
+ * mixHash
+ *
+ * The MurmurHash3 finalizer, a cheap bijective mix of all 32 bits.
+ */
+static unsigned int mixHash(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * bucketsOf
+ *
+ * Compute the two buckets a key may live in. They differ whenever the table
+ * has more than one bucket. The second bucket is the first one XORed with an
+ * odd hash, so after the table doubles, the low bits of both buckets are still
+ * the two buckets of the smaller table.
+ */
+static void bucketsOf(const CuckooTable *table, unsigned int key, unsigned int *first,
+                      unsigned int *second)
+{
+    unsigned int h = mixHash(key ^ SEED_PRIMARY);
+    *first = h & table->mask;
+    *second = (h ^ (mixHash(key ^ SEED_ALTERNATE) | 1)) & table->mask;
+}
+
+/**
+ * otherBucket
+ *
+ * Return the bucket that the key may live in besides the given one.
+ */
+static unsigned int otherBucket(const CuckooTable *table, unsigned int key, unsigned int bucket)
+{
+    unsigned int first, second;
+    bucketsOf(table, key, &first, &second);
+    return bucket == first ? second : first;
+}
+
+/**
+ * findInBucket
+ *
+ * Return the slot of the key in the bucket, or -1 if it is not there.
+ */
+static int findInBucket(const CuckooBucket *bucket, unsigned int key)
+{
+    int slot;
+    for (slot = 0; slot < SLOTS_PER_BUCKET; ++slot)
+    {
+        if ((bucket->occupied & (1u << slot)) && bucket->keys[slot] == key)
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * freeSlot
+ *
+ * Return a free slot of the bucket, or -1 if it is full.
+ */
+static int freeSlot(const CuckooBucket *bucket)
+{
+    int slot;
+    for (slot = 0; slot < SLOTS_PER_BUCKET; ++slot)
+    {
+        if (!(bucket->occupied & (1u << slot)))
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * findItem
+ *
+ * Look up a key in its two buckets.
+ *
+ * @return the bucket holding the key, or NULL if the key is not present
+ */
+static CuckooBucket *findItem(CuckooTable *table, unsigned int key, int *slot)
+{
+    unsigned int first, second;
+    bucketsOf(table, key, &first, &second);
+
+    *slot = findInBucket(&table->buckets[first], key);
+    if (*slot >= 0)
+    {
+        return &table->buckets[first];
+    }
+    *slot = findInBucket(&table->buckets[second], key);
+    if (*slot >= 0)
+    {
+        return &table->buckets[second];
+    }
+    return NULL;
+}
+
+/**
+ * onSearchPath
+ *
+ * Check whether a bucket already appears on the search path that leads to node.
+ * A path through the same bucket twice could move one item twice.
+ */
+static int onSearchPath(const SearchNode *nodes, int node, unsigned int bucket)
+{
+    for (; node >= 0; node = nodes[node].parent)
+    {
+        if (nodes[node].bucket == bucket)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * pathLength
+ *
+ * The number of items that have to move to free a slot in the bucket of node.
+ */
+static int pathLength(const SearchNode *nodes, int node)
+{
+    int length = 0;
+    for (; nodes[node].parent >= 0; node = nodes[node].parent)
+    {
+        ++length;
+    }
+    return length;
+}
+
+/**
+ * makeRoom
+ *
+ * Free a slot in one of the two buckets of a key, moving items to their other
+ * bucket along the shortest path found by a breadth-first search.
+ *
+ * @param table The pointer to the cuckoo table.
+ * @param key The key that needs a slot.
+ * @param maxPathLength The number of items that may move, 0 to only look for
+ *        a free slot.
+ * @param bucketOut Set to the bucket with the free slot.
+ * @param slotOut Set to the free slot.
+ * @return 1 if a slot was freed, 0 if the table has to grow
+ */
+static int makeRoom(CuckooTable *table, unsigned int key, int maxPathLength,
+                    unsigned int *bucketOut, int *slotOut)
+{
+    SearchNode nodes[MAX_SEARCH_NODES];
+    int numNodes = 0;
+    unsigned int first, second;
+    bucketsOf(table, key, &first, &second);
+
+    nodes[numNodes++] = (SearchNode){first, -1, 0};
+    if (second != first)
+    {
+        nodes[numNodes++] = (SearchNode){second, -1, 0};
+    }
+
+    int head;
+    for (head = 0; head < numNodes; ++head)
+    {
+        CuckooBucket *bucket = &table->buckets[nodes[head].bucket];
+        int slot = freeSlot(bucket);
+        if (slot >= 0)
+        {
+            // Shift the items along the path, starting from the free slot, so
+            // every move goes into the slot vacated by the previous one.
+            int node = head;
+            while (nodes[node].parent >= 0)
+            {
+                CuckooBucket *to = &table->buckets[nodes[node].bucket];
+                CuckooBucket *from = &table->buckets[nodes[nodes[node].parent].bucket];
+                unsigned int fromSlot = nodes[node].slot;
+
+                to->keys[slot] = from->keys[fromSlot];
+                to->values[slot] = from->values[fromSlot];
+                to->occupied |= 1u << slot;
+                from->occupied &= ~(1u << fromSlot);
+
+                slot = (int)fromSlot;
+                node = nodes[node].parent;
+            }
+            *bucketOut = nodes[node].bucket;
+            *slotOut = slot;
+            return 1;
+        }
+
+        if (pathLength(nodes, head) == maxPathLength)
+        {
+            continue;
+        }
+        unsigned int s;
+        for (s = 0; s < SLOTS_PER_BUCKET && numNodes < MAX_SEARCH_NODES; ++s)
+        {
+            unsigned int next = otherBucket(table, bucket->keys[s], nodes[head].bucket);
+            if (!onSearchPath(nodes, head, next))
+            {
+                nodes[numNodes++] = (SearchNode){next, head, s};
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * allocateBuckets
+ *
+ * Point the table at a new, empty, cache-line-aligned array of mask + 1
+ * buckets. The allocator only promises malloc alignment, so if the exact size
+ * does not come back aligned, one extra cache line is requested to align the
+ * array by hand. Asking for the exact size first matters for allocators that
+ * hand out whole pages: padding a power-of-two array would cost a full extra
+ * (huge) page.
+ */
+static void allocateBuckets(CuckooTable *table, unsigned int mask)
+{
+    size_t size = ((size_t)mask + 1) * sizeof(CuckooBucket);
+    void *raw = checkedAlloc(&table->allocator, size);
+    if ((uintptr_t)raw & (CACHE_LINE_SIZE - 1))
+    {
+        table->allocator.free(table->allocator.context, raw, size);
+        size += CACHE_LINE_SIZE;
+        raw = checkedAlloc(&table->allocator, size);
+    }
+    uintptr_t aligned = ((uintptr_t)raw + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+
+    table->raw_buckets = raw;
+    table->raw_size = size;
+    table->buckets = (CuckooBucket *)aligned;
+    table->mask = mask;
+    memset(table->buckets, 0, ((size_t)mask + 1) * sizeof(CuckooBucket));
+}
+
+/**
+ * grow
+ *
+ * Double the number of buckets and reinsert every item into the new bucket
+ * that extends its old one (same low bits). Each new bucket only receives
+ * items from a single old bucket, so they always fit without moving anything,
+ * and a scan cursor can carry on across the resize.
+ */
+static void grow(CuckooTable *table)
+{
+    CuckooBucket *oldBuckets = table->buckets;
+    unsigned int oldMask = table->mask;
+    void *oldRaw = table->raw_buckets;
+    size_t oldSize = table->raw_size;
+
+    allocateBuckets(table, (oldMask << 1) | 1);
+
+    unsigned int b;
+    for (b = 0; b <= oldMask; ++b)
+    {
+        int s;
+        for (s = 0; s < SLOTS_PER_BUCKET; ++s)
+        {
+            if (!(oldBuckets[b].occupied & (1u << s)))
+            {
+                continue;
+            }
+            unsigned int first, second;
+            bucketsOf(table, oldBuckets[b].keys[s], &first, &second);
+            CuckooBucket *bucket = &table->buckets[(first & oldMask) == b ? first : second];
+            int slot = freeSlot(bucket);
+
+            bucket->keys[slot] = oldBuckets[b].keys[s];
+            bucket->values[slot] = oldBuckets[b].values[s];
+            bucket->occupied |= 1u << slot;
+        }
+    }
+
+    table->allocator.free(table->allocator.context, oldRaw, oldSize);
+}
+
+/**
+ * reverseBits
+ *
+ * Reverse the bits of a 32-bit cursor.
+ */
+static unsigned int reverseBits(unsigned int v)
+{
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+    v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+/****************************************************************************
+ * Engine Interface Functions
+ ****************************************************************************/
+CuckooTable *cuckooCreate(unsigned int numBuckets, const HashTableAllocator *allocator)
+{
+    CuckooTable *table = (CuckooTable *)checkedAlloc(allocator, sizeof(CuckooTable));
+    table->allocator = *allocator;
+    table->active_scans = 0;
+
+    unsigned int mask = 0;
+    while (mask < numBuckets - 1)
+    {
+        mask = (mask << 1) | 1;
+    }
+    allocateBuckets(table, mask);
+    return table;
+}
+
+void cuckooDestroy(CuckooTable *table)
+{
+    HashTableAllocator allocator = table->allocator;
+    allocator.free(allocator.context, table->raw_buckets, table->raw_size);
+    allocator.free(allocator.context, table, sizeof(CuckooTable));
+}
+
+void *cuckooGet(CuckooTable *table, unsigned int key)
+{
+    int slot;
+    CuckooBucket *bucket = findItem(table, key, &slot);
+    return bucket ? bucket->values[slot] : NULL;
+}
+
+void **cuckooSlot(CuckooTable *table, unsigned int key, int *inserted)
+{
+    int slot;
+    CuckooBucket *bucket = findItem(table, key, &slot);
+    if (bucket)
+    {
+        *inserted = 0;
+        return &bucket->values[slot];
+    }
+
+    // Moving items could make a scan in progress miss them or visit them twice.
+    int maxPathLength = table->active_scans ? 0 : MAX_PATH_LENGTH;
+    unsigned int bucketInd;
+    while (!makeRoom(table, key, maxPathLength, &bucketInd, &slot))
+    {
+        grow(table);
+    }
+    bucket = &table->buckets[bucketInd];
+    bucket->keys[slot] = key;
+    bucket->values[slot] = NULL;
+    bucket->occupied |= 1u << slot;
+    *inserted = 1;
+    return &bucket->values[slot];
+}
+
+void *cuckooRemove(CuckooTable *table, unsigned int key, int *found)
+{
+    int slot;
+    CuckooBucket *bucket = findItem(table, key, &slot);
+    *found = bucket != NULL;
+    if (!bucket)
+    {
+        return NULL;
+    }
+    bucket->occupied &= ~(1u << slot);
+    return bucket->values[slot];
+}
+
+unsigned int cuckooRemoveIf(CuckooTable *table, RemovePredicate predicate, void *context,
+                            RemoveCallback onRemoved)
+{
+    // 1. Clear every matching slot in one pass, remembering the items so they
+    //    are only reported once the table is stable again.
+    RemovedItem *removed = NULL;
+    unsigned int numRemoved = 0;
+    unsigned int capacity = 0;
+    unsigned int b;
+    for (b = 0; b <= table->mask; ++b)
+    {
+        CuckooBucket *bucket = &table->buckets[b];
+        int s;
+        for (s = 0; s < SLOTS_PER_BUCKET; ++s)
+        {
+            if (!(bucket->occupied & (1u << s)) ||
+                !predicate(bucket->keys[s], bucket->values[s], context))
+            {
+                continue;
+            }
+            if (numRemoved == capacity)
+            {
+                unsigned int newCapacity = capacity ? 2 * capacity : 16;
+                RemovedItem *grown = (RemovedItem *)checkedAlloc(NULL, newCapacity * sizeof(RemovedItem));
+                if (removed)
+                {
+                    memcpy(grown, removed, numRemoved * sizeof(RemovedItem));
+                    free(removed);
+                }
+                removed = grown;
+                capacity = newCapacity;
+            }
+            removed[numRemoved].key = bucket->keys[s];
+            removed[numRemoved].value = bucket->values[s];
+            ++numRemoved;
+            bucket->occupied &= ~(1u << s);
+        }
+    }
+
+    // 2. Report or free the removed items in one batch.
+    unsigned int i;
+    for (i = 0; i < numRemoved; ++i)
+    {
+        if (onRemoved)
+        {
+            onRemoved(removed[i].key, removed[i].value, context);
+        }
+        else
+        {
+            free(removed[i].value);
+        }
+    }
+    free(removed);
+    return numRemoved;
+}
+
+unsigned int cuckooScan(CuckooTable *table, unsigned int cursor, unsigned int maxItems,
+                        ScanCallback callback, void *context)
+{
+    // The cursor counts up in the high bits first (as in Redis SCAN). When the
+    // table doubles, the buckets an item can move to share the low bits of its
+    // old bucket, so the buckets visited before cover the same part of the
+    // key space in the bigger table.
+    if (maxItems == 0)
+    {
+        maxItems = 1;
+    }
+    if (cursor == 0)
+    {
+        ++table->active_scans;
+    }
+    unsigned long long bucketBudget = 10ULL * maxItems;
+    unsigned int visited = 0;
+
+    do
+    {
+        CuckooBucket *bucket = &table->buckets[cursor & table->mask];
+        int s;
+        for (s = 0; s < SLOTS_PER_BUCKET; ++s)
+        {
+            if (bucket->occupied & (1u << s))
+            {
+                callback(bucket->keys[s], bucket->values[s], context);
+                ++visited;
+            }
+        }
+
+        cursor |= ~table->mask;
+        cursor = reverseBits(cursor);
+        ++cursor;
+        cursor = reverseBits(cursor);
+    } while (cursor != 0 && visited < maxItems && --bucketBudget);
+
+    if (cursor == 0)
+    {
+        --table->active_scans;
+    }
+    return cursor;
+}
@@ -0,0 +1,124 @@
+// ============================================
+// The private header file for the cuckoo hashing engine.
+//
+// Copyright 2023 Georgia Tech. All rights reserved.
+// The materials provided by the instructor in this course are for
+// the use of the students currently enrolled in the course.
+// Copyrighted course materials may not be further disseminated.
+// This file must NOT be made publicly available anywhere.
+//==================================================================
+
+/****************************************************************************
+ * This header is private to the hash table module. Users create a cuckoo
+ * table with createCuckooHashTable from hash_table.h, and hash_table.c
+ * forwards the public interface functions to the engine declared here.
+ ***************************************************************************/
+#ifndef CUCKOO_TABLE_H
+#define CUCKOO_TABLE_H
+
+#include "hash_table.h"
+
+/**
+ * checkedAlloc
+ *
+ * Allocate through the allocator, or malloc if it is NULL, and print a message
+ * and exit if it runs out of memory. Implemented in hash_table.c.
+ *
+ * @param allocator The allocator to use, or NULL for malloc.
+ * @param size The number of bytes to allocate.
+ * @return the new block, never NULL
+ */
+void* checkedAlloc(const HashTableAllocator* allocator, size_t size);
+
+/**
+ * An item taken out by removeIf or cuckooRemoveIf, kept until it is reported.
+ */
+typedef struct _RemovedItem
+{
+    unsigned int key;
+    void* value;
+} RemovedItem;
+
+/**
+ * This defines a type that is a _CuckooTable struct. The definition for
+ * _CuckooTable is implemented in cuckoo_table.c.
+ */
+typedef struct _CuckooTable CuckooTable;
+
+/**
+ * cuckooCreate
+ *
+ * Creates a cuckoo table with room for at least numBuckets buckets of four
+ * slots each. The bucket count is rounded up to a power of two.
+ *
+ * @param numBuckets The initial number of buckets (at least 1).
+ * @param allocator The allocator for the table and its buckets.
+ * @return a pointer to the new cuckoo table
+ */
+CuckooTable* cuckooCreate(unsigned int numBuckets, const HashTableAllocator* allocator);
+
+/**
+ * cuckooDestroy
+ *
+ * Destroy the cuckoo table. Values are not freed.
+ *
+ * @param table The pointer to the cuckoo table.
+ */
+void cuckooDestroy(CuckooTable* table);
+
+/**
+ * cuckooGet
+ *
+ * Get the value for a key, probing at most its two buckets.
+ *
+ * @param table The pointer to the cuckoo table.
+ * @param key The key that corresponds to the item.
+ * @return the value, or NULL if the key is not present
+ */
+void* cuckooGet(CuckooTable* table, unsigned int key);
+
+/**
+ * cuckooSlot
+ *
+ * Get the value slot for a key, inserting the key with a NULL value if it is
+ * not present. Inserting may displace other items or grow the table, which
+ * invalidates slots returned earlier.
+ *
+ * @param table The pointer to the cuckoo table.
+ * @param key The key that corresponds to the item.
+ * @param inserted Set to 1 if the key was inserted and 0 otherwise.
+ * @return a pointer to the value slot of the key
+ */
+void** cuckooSlot(CuckooTable* table, unsigned int key, int* inserted);
+
+/**
+ * cuckooRemove
+ *
+ * Remove the item for a key.
+ *
+ * @param table The pointer to the cuckoo table.
+ * @param key The key that corresponds to the item.
+ * @param found Set to 1 if the key was present and 0 otherwise.
+ * @return the removed value, or NULL if the key is not present
+ */
+void* cuckooRemove(CuckooTable* table, unsigned int key, int* found);
+
+/**
+ * cuckooRemoveIf
+ *
+ * Same contract as removeIf in hash_table.h.
+ */
+unsigned int cuckooRemoveIf(CuckooTable* table, RemovePredicate predicate, void* context,
+                            RemoveCallback onRemoved);
+
+/**
+ * cuckooScan
+ *
+ * Same contract as scanHashTable in hash_table.h, with a reverse-binary cursor
+ * so that growing the table between calls does not skip buckets. Until the
+ * scan returns 0, cuckooSlot does not move items.
+ */
+unsigned int cuckooScan(CuckooTable* table, unsigned int cursor, unsigned int maxItems,
+                        ScanCallback callback, void* context);
+
+#endif
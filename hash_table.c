@@ -17,6 +17,7 @@
  * correctness, but it is better than nothing!
  ***************************************************************************/
 #include "hash_table.h"
+#include "cuckoo_table.h"
 
 /****************************************************************************
  * Include other private dependencies
@@ -24,8 +25,9 @@
  * These other modules are used in the implementation of the hash table module,
  * but are not required by users of the hash table.
  ***************************************************************************/
-#include <stdlib.h> // For malloc and free
+#include <stdlib.h> // For malloc, free and qsort
 #include <stdio.h>  // For printf
+#include <limits.h> // For UINT_MAX
 
 /****************************************************************************
  * Hidden Definitions
@@ -34,6 +36,15 @@
  * the are forward declared in hash_table.h, the type names are
  * available everywhere and user code can hold pointers to these structs.
  ***************************************************************************/
+/** The death version of an entry that has not been removed */
+#define ENTRY_ALIVE UINT_MAX
+
+/**
+ * The version at which the live table is viewed. Every live entry was born at
+ * or before it and dies after it, while every removed entry died before it.
+ */
+#define LIVE_VIEW (ENTRY_ALIVE - 1)
+
 /**
  * This structure represents an a hash table.
  * Use "HashTable" instead when you are creating a new variable. [See top comments]
@@ -49,6 +60,27 @@ struct _HashTable
 
     /** The number of buckets in the hash table */
     unsigned int num_buckets;
+
+    /** The allocator used for the table, its buckets and its entries */
+    HashTableAllocator allocator;
+
+    /**
+     * The current version. Writes stamp entries with it, and taking a snapshot
+     * freezes it for the snapshot and moves the table on to the next one.
+     */
+    unsigned int version;
+
+    /** The live snapshots, oldest first */
+    HashTableSnapshot *oldest_snapshot;
+
+    /** The live snapshots, newest first */
+    HashTableSnapshot *newest_snapshot;
+
+    /**
+     * The cuckoo engine for tables made by createCuckooHashTable, or NULL.
+     * When set, buckets is unused and every operation is forwarded to it.
+     */
+    CuckooTable *cuckoo;
 };
 
 /**
@@ -60,6 +92,9 @@ struct _HashTableEntry
     /** The key for the hash table entry */
     unsigned int key;
 
+    /** The table version at which the entry was written */
+    unsigned int born;
+
     /** The value associated with this hash table entry */
     void *value;
 
@@ -68,26 +103,135 @@ struct _HashTableEntry
      * NULL means there is no next entry (i.e. this is the tail)
      */
     HashTableEntry *next;
+
+    /**
+     * The table version at which the entry was removed or overwritten, or
+     * ENTRY_ALIVE. A removed entry stays in its chain while a snapshot sees it.
+     */
+    unsigned int died;
+
+    /** Whether value is freed along with the entry (set by deleteItem) */
+    int owns_value;
+
+    /** The next entry on the retired list of the same snapshot */
+    HashTableEntry *next_retired;
+};
+
+/**
+ * This structure represents a snapshot of a hash table. An entry is part of the
+ * snapshot if born <= version < died.
+ * Use "HashTableSnapshot" instead when you are creating a new variable. [See top comments]
+ */
+struct _HashTableSnapshot
+{
+    /** The table the snapshot was taken of */
+    HashTable *table;
+
+    /** The table version the snapshot sees */
+    unsigned int version;
+
+    /** The next older and newer live snapshots of the table */
+    HashTableSnapshot *older;
+    HashTableSnapshot *newer;
+
+    /**
+     * The entries removed or overwritten while this was the newest snapshot,
+     * linked through next_retired. They are the only entries that releasing
+     * this snapshot can free.
+     */
+    HashTableEntry *retired;
 };
 
+/**
+ * This structure pairs a key passed to removeItems with its bucket, so the
+ * keys can be sorted into per-bucket groups.
+ */
+typedef struct _BulkKey
+{
+    /** The bucket the key hashes to */
+    unsigned int bucket;
+
+    /** The position of the key in the array passed by the user */
+    unsigned int index;
+} BulkKey;
+
 /****************************************************************************
  * Private Functions
  *
  * These functions are not available outside of this file, since they are not
  * declared in hash_table.h.
  ***************************************************************************/
+/**
+ * mallocAlloc / mallocFree
+ *
+ * The default allocator, which forwards to malloc and free.
+ */
+static void *mallocAlloc(void *context, size_t size)
+{
+    (void)context;
+    return malloc(size);
+}
+
+static void mallocFree(void *context, void *ptr, size_t size)
+{
+    (void)context;
+    (void)size;
+    free(ptr);
+}
+
+static const HashTableAllocator defaultAllocator = {mallocAlloc, mallocFree, NULL};
+
+/**
+ * checkedAlloc
+ *
+ * Helper that allocates through an allocator and exits gracefully, like an
+ * empty bucket count does, if the allocator runs out of memory. It is declared
+ * in cuckoo_table.h so the cuckoo engine shares this out-of-memory path.
+ */
+void *checkedAlloc(const HashTableAllocator *allocator, size_t size)
+{
+    if (!allocator)
+    {
+        allocator = &defaultAllocator;
+    }
+    void *ptr = allocator->alloc(allocator->context, size);
+    if (!ptr)
+    {
+        printf("Hash table could not allocate %zu bytes...\n", size);
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * htAlloc / htFree
+ *
+ * Helpers that route an allocation through the allocator of the hash table.
+ */
+static void *htAlloc(HashTable *hashTable, size_t size)
+{
+    return checkedAlloc(&hashTable->allocator, size);
+}
+
+static void htFree(HashTable *hashTable, void *ptr, size_t size)
+{
+    hashTable->allocator.free(hashTable->allocator.context, ptr, size);
+}
+
 /**
  * createHashTableEntry
  *
- * Helper function that creates a hash table entry by allocating memory for it on
- * the heap. It initializes the entry with key and value, initialize pointer to
- * the next entry as NULL, and return the pointer to this hash table entry.
+ * Helper function that creates a hash table entry by allocating memory for it
+ * through the allocator of the hash table. It initializes the entry with key and
+ * value, initialize pointer to the next entry as NULL, and return the pointer to
+ * this hash table entry.
  *
+ * @param hashTable The pointer to the hash table.
  * @param key The key corresponds to the hash table entry
  * @param value The value stored in the hash table entry
  * @return The pointer to the hash table entry
  */
-static HashTableEntry *createHashTableEntry(unsigned int key, void *value)
+static HashTableEntry *createHashTableEntry(HashTable *hashTable, unsigned int key, void *value)
 {
      // TODO: Implement
     // 1. Create an initialize a new hash table entry given an input key and value
@@ -95,13 +239,194 @@ static HashTableEntry *createHashTableEntry(unsigned int key, void *value)
     //     Note: Make sure to initialize the next pointer to null
     
     // 2. Return the new hash table entry
-    HashTableEntry *newEntry = (HashTableEntry *)malloc(sizeof(HashTableEntry));
+    HashTableEntry *newEntry = (HashTableEntry *)htAlloc(hashTable, sizeof(HashTableEntry));
     newEntry->key = key;
     newEntry->value = value;
     newEntry->next = NULL;
+    newEntry->born = hashTable->version;
+    newEntry->died = ENTRY_ALIVE;
+    newEntry->owns_value = 0;
+    newEntry->next_retired = NULL;
     return newEntry;
 }
 
+/**
+ * isVisible
+ *
+ * Helper function that checks whether an entry is part of the table as seen at
+ * the given version. Use LIVE_VIEW for the live table.
+ */
+static int isVisible(const HashTableEntry *entry, unsigned int version)
+{
+    return entry->born <= version && version < entry->died;
+}
+
+/**
+ * isShared
+ *
+ * Helper function that checks whether any live snapshot sees the entry. An
+ * entry that is not shared can be changed or freed in place.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param entry The entry to check
+ * @return 1 if a live snapshot sees the entry, 0 otherwise
+ */
+static int isShared(HashTable *hashTable, const HashTableEntry *entry)
+{
+    // Walk from the newest snapshot down: once they are older than the entry,
+    // no remaining one can see it either.
+    HashTableSnapshot *snapshot = hashTable->newest_snapshot;
+    while (snapshot && snapshot->version >= entry->born)
+    {
+        if (snapshot->version < entry->died)
+        {
+            return 1;
+        }
+        snapshot = snapshot->older;
+    }
+    return 0;
+}
+
+/**
+ * findSharedCopy
+ *
+ * Helper function that looks for an older copy of an entry that still shows
+ * the same value to a snapshot. A write copies an entry without copying its
+ * value, and the copy goes to the head of the chain, so older copies are always
+ * further down the chain.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param entry The entry whose value is about to leave the table
+ * @return the newest such copy, or NULL if no snapshot sees the value
+ */
+static HashTableEntry *findSharedCopy(HashTable *hashTable, const HashTableEntry *entry)
+{
+    HashTableEntry *older = entry->next;
+    while (older)
+    {
+        if (older->key == entry->key && older->value == entry->value &&
+            older->died != ENTRY_ALIVE && isShared(hashTable, older))
+        {
+            return older;
+        }
+        older = older->next;
+    }
+    return NULL;
+}
+
+/**
+ * freeHashTableEntry
+ *
+ * Helper function that frees a hash table entry, and its value if the entry
+ * owns it. If an older copy of the entry still shows the value to a snapshot,
+ * that copy takes the value over instead.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param entry The entry to free, already unlinked from its chain
+ */
+static void freeHashTableEntry(HashTable *hashTable, HashTableEntry *entry)
+{
+    if (entry->owns_value)
+    {
+        // Without snapshots there are no older copies, so skip the chain walk.
+        HashTableEntry *copy = hashTable->newest_snapshot ? findSharedCopy(hashTable, entry) : NULL;
+        if (copy)
+        {
+            copy->owns_value = 1;
+        }
+        else
+        {
+            free(entry->value);
+        }
+    }
+    htFree(hashTable, entry, sizeof(HashTableEntry));
+}
+
+/**
+ * retireEntry
+ *
+ * Helper function that marks a live entry as removed or overwritten while a
+ * snapshot still sees it. The entry stays in its chain, and is put on the
+ * retired list of the newest snapshot so that releasing snapshots can free it.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param entry The entry to retire
+ */
+static void retireEntry(HashTable *hashTable, HashTableEntry *entry)
+{
+    entry->died = hashTable->version;
+    entry->next_retired = hashTable->newest_snapshot->retired;
+    hashTable->newest_snapshot->retired = entry;
+}
+
+/**
+ * detachEntry
+ *
+ * Helper function that takes a live entry out of the table. If no snapshot sees
+ * the entry it is unlinked and freed right away, otherwise it is only marked as
+ * removed and stays in its chain for the snapshots.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param link The pointer that links to the entry in its chain
+ * @param freeValue Whether the value of the entry is freed along with it
+ * @return 1 if the entry was unlinked, 0 if it stays in the chain
+ */
+static int detachEntry(HashTable *hashTable, HashTableEntry **link, int freeValue)
+{
+    HashTableEntry *entry = *link;
+    entry->owns_value = freeValue;
+    if (isShared(hashTable, entry))
+    {
+        retireEntry(hashTable, entry);
+        return 0;
+    }
+    *link = entry->next;
+    freeHashTableEntry(hashTable, entry);
+    return 1;
+}
+
+/**
+ * unlinkEntry
+ *
+ * Helper function that takes an entry out of its chain, without freeing it.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param entry The entry to unlink
+ */
+static void unlinkEntry(HashTable *hashTable, HashTableEntry *entry)
+{
+    HashTableEntry **link = &hashTable->buckets[hashTable->hash(entry->key)];
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+}
+
+/**
+ * findVisibleItem
+ *
+ * Helper function that returns the entry for a key as seen at the given version.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param key The key corresponds to the hash table entry
+ * @param version The version to look at, or LIVE_VIEW
+ * @return The pointer to the hash table entry, or NULL if key does not exist
+ */
+static HashTableEntry *findVisibleItem(HashTable *hashTable, unsigned int key, unsigned int version)
+{
+    HashTableEntry *tmp = hashTable->buckets[hashTable->hash(key)];
+    while (tmp)
+    {
+        if (tmp->key == key && isVisible(tmp, version))
+        {
+            return tmp;
+        }
+        tmp = tmp->next;
+    }
+    return NULL;
+}
+
 /**
  * findItem
  *
@@ -127,8 +452,9 @@ static HashTableEntry *findItem(HashTable *hashTable, unsigned int key)
     //      4a. While you are not at end node of the hash table 
     //      4b. If the key is found, return the hash table entry
     //      4c. Otherwise, move to the next node
+    //      (Entries that were removed but are still kept for a snapshot are skipped.)
     while (tmp != NULL) {
-        if (tmp -> key == key) {
+        if (tmp -> key == key && tmp -> died == ENTRY_ALIVE) {
             return tmp;
         }
         tmp = tmp -> next;
@@ -138,6 +464,205 @@ static HashTableEntry *findItem(HashTable *hashTable, unsigned int key)
     return NULL;
 }
 
+/**
+ * findOrCreateItem
+ *
+ * Helper function that returns the hash table entry for a key, creating it with
+ * a NULL value at the head of its bucket if the key is not present. The key is
+ * hashed once and the chain walked once.
+ *
+ * The entry is about to be written, so if a snapshot sees the existing entry it
+ * is retired and a copy is returned instead.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param key The key corresponds to the hash table entry
+ * @param inserted Set to 1 if the entry was created and 0 otherwise
+ * @return The pointer to the hash table entry
+ */
+static HashTableEntry *findOrCreateItem(HashTable *hashTable, unsigned int key, int *inserted)
+{
+    unsigned int bucketInd = hashTable->hash(key);
+    HashTableEntry **link = &hashTable->buckets[bucketInd];
+    HashTableEntry *found = NULL;
+    while (*link)
+    {
+        HashTableEntry *tmp = *link;
+        if (tmp->key == key && tmp->died == ENTRY_ALIVE)
+        {
+            found = tmp;
+            break;
+        }
+        link = &tmp->next;
+    }
+
+    *inserted = !found;
+    if (found && !isShared(hashTable, found))
+    {
+        return found;
+    }
+
+    // Copy-on-write: the snapshots keep the old entry, the table gets a new one.
+    HashTableEntry *newEntry = createHashTableEntry(hashTable, key, found ? found->value : NULL);
+    if (found)
+    {
+        retireEntry(hashTable, found);
+    }
+    newEntry->next = hashTable->buckets[bucketInd];
+    hashTable->buckets[bucketInd] = newEntry;
+    return newEntry;
+}
+
+/**
+ * findOrCreateSlot
+ *
+ * Helper function that returns the value slot for a key from either engine,
+ * inserting the key with a NULL value if it is not present.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param key The key corresponds to the hash table entry
+ * @param inserted Set to 1 if the key was inserted and 0 otherwise
+ * @return The pointer to the value slot
+ */
+static void **findOrCreateSlot(HashTable *hashTable, unsigned int key, int *inserted)
+{
+    if (hashTable->cuckoo)
+    {
+        return cuckooSlot(hashTable->cuckoo, key, inserted);
+    }
+    return &findOrCreateItem(hashTable, key, inserted)->value;
+}
+
+/**
+ * compareBulkKeys
+ *
+ * qsort comparator that orders keys by bucket, and by their position in the
+ * user array within a bucket so duplicate keys resolve to the first occurrence.
+ */
+static int compareBulkKeys(const void *a, const void *b)
+{
+    const BulkKey *x = (const BulkKey *)a;
+    const BulkKey *y = (const BulkKey *)b;
+    if (x->bucket != y->bucket)
+    {
+        return x->bucket < y->bucket ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+/**
+ * bulkRemove
+ *
+ * Shared implementation of removeItems and deleteItems. The keys are sorted by
+ * bucket, then each bucket with at least one key is walked once, detaching every
+ * live node whose key is still wanted. The walk stops early once all keys of the
+ * group have been found.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param keys The keys of the items to remove.
+ * @param numKeys The number of keys.
+ * @param removedValues Optional output of the removed value per key.
+ * @param freeValues Whether removed values are freed.
+ * @return the number of items removed
+ */
+static unsigned int bulkRemove(HashTable *hashTable, const unsigned int *keys, unsigned int numKeys,
+                               void **removedValues, int freeValues)
+{
+    if (numKeys == 0)
+    {
+        return 0;
+    }
+
+    // Cuckoo lookups probe at most two buckets anyway, so there are no chains
+    // worth grouping the keys for.
+    unsigned int i;
+    if (hashTable->cuckoo)
+    {
+        unsigned int removed = 0;
+        for (i = 0; i < numKeys; ++i)
+        {
+            int found;
+            void *value = cuckooRemove(hashTable->cuckoo, keys[i], &found);
+            removed += found;
+            if (removedValues)
+            {
+                removedValues[i] = value;
+            }
+            if (freeValues)
+            {
+                free(value);
+            }
+        }
+        return removed;
+    }
+
+    // Transient scratch comes from malloc, so it never lands in the table's arena.
+    BulkKey *order = (BulkKey *)checkedAlloc(NULL, numKeys * sizeof(BulkKey));
+    for (i = 0; i < numKeys; ++i)
+    {
+        order[i].bucket = hashTable->hash(keys[i]);
+        order[i].index = i;
+        if (removedValues)
+        {
+            removedValues[i] = NULL;
+        }
+    }
+    qsort(order, numKeys, sizeof(BulkKey), compareBulkKeys);
+
+    unsigned int removed = 0;
+    unsigned int start = 0;
+    while (start < numKeys)
+    {
+        // The keys in order[start, end) all share one bucket.
+        unsigned int bucket = order[start].bucket;
+        unsigned int end = start + 1;
+        while (end < numKeys && order[end].bucket == bucket)
+        {
+            ++end;
+        }
+
+        unsigned int pending = end - start;
+        HashTableEntry **link = &hashTable->buckets[bucket];
+        while (*link && pending)
+        {
+            HashTableEntry *curr = *link;
+            unsigned int j = end;
+            if (curr->died == ENTRY_ALIVE)
+            {
+                j = start;
+            }
+            for (; j < end; ++j)
+            {
+                // A found key is marked by pointing its bucket past the table.
+                if (order[j].bucket == bucket && keys[order[j].index] == curr->key)
+                {
+                    break;
+                }
+            }
+            if (j == end)
+            {
+                link = &curr->next;
+                continue;
+            }
+
+            order[j].bucket = hashTable->num_buckets;
+            --pending;
+            ++removed;
+            if (removedValues)
+            {
+                removedValues[order[j].index] = curr->value;
+            }
+            if (!detachEntry(hashTable, link, freeValues))
+            {
+                link = &curr->next;
+            }
+        }
+        start = end;
+    }
+
+    free(order);
+    return removed;
+}
+
 /****************************************************************************
  * Public Interface Functions
  *
@@ -147,6 +672,12 @@ static HashTableEntry *findItem(HashTable *hashTable, unsigned int key)
  ****************************************************************************/
 // The createHashTable is provided for you as a starting point.
 HashTable *createHashTable(HashFunction hashFunction, unsigned int numBuckets)
+{
+    return createHashTableWithAllocator(hashFunction, numBuckets, NULL);
+}
+
+HashTable *createHashTableWithAllocator(HashFunction hashFunction, unsigned int numBuckets,
+                                        const HashTableAllocator *allocator)
 {
     // The hash table has to contain at least one bucket. Exit gracefully if
     // this condition is not met.
@@ -156,13 +687,23 @@ HashTable *createHashTable(HashFunction hashFunction, unsigned int numBuckets)
         exit(1);
     }
 
-    // Allocate memory for the new HashTable struct on heap.
-    HashTable *newTable = (HashTable *)malloc(sizeof(HashTable));
+    if (!allocator)
+    {
+        allocator = &defaultAllocator;
+    }
+
+    // Allocate memory for the new HashTable struct through the allocator.
+    HashTable *newTable = (HashTable *)checkedAlloc(allocator, sizeof(HashTable));
 
     // Initialize the components of the new HashTable struct.
+    newTable->allocator = *allocator;
     newTable->hash = hashFunction;
     newTable->num_buckets = numBuckets;
-    newTable->buckets = (HashTableEntry **)malloc(numBuckets * sizeof(HashTableEntry *));
+    newTable->buckets = (HashTableEntry **)htAlloc(newTable, numBuckets * sizeof(HashTableEntry *));
+    newTable->version = 1;
+    newTable->oldest_snapshot = NULL;
+    newTable->newest_snapshot = NULL;
+    newTable->cuckoo = NULL;
 
     // As the new buckets are empty, init each bucket as NULL.
     unsigned int i;
@@ -175,43 +716,92 @@ HashTable *createHashTable(HashFunction hashFunction, unsigned int numBuckets)
     return newTable;
 }
 
+HashTable *createCuckooHashTable(unsigned int numBuckets, const HashTableAllocator *allocator)
+{
+    if (numBuckets == 0)
+    {
+        printf("Hash table has to contain at least 1 bucket...\n");
+        exit(1);
+    }
+
+    if (!allocator)
+    {
+        allocator = &defaultAllocator;
+    }
+
+    // The chained part of the table stays empty, the engine holds the items.
+    HashTable *newTable = (HashTable *)checkedAlloc(allocator, sizeof(HashTable));
+    newTable->allocator = *allocator;
+    newTable->hash = NULL;
+    newTable->num_buckets = 0;
+    newTable->buckets = NULL;
+    newTable->version = 1;
+    newTable->oldest_snapshot = NULL;
+    newTable->newest_snapshot = NULL;
+    newTable->cuckoo = cuckooCreate(numBuckets, allocator);
+    return newTable;
+}
+
 void destroyHashTable(HashTable *hashTable)
 {
     // TODO: Implement
     // 1. Loop through each bucket of the hash table to remove all items.
     //      1a. set temp to be the first entry of the ith bucket
     //      1b. delete all entries
+    //    (A cuckoo table keeps its items in the engine, and has no buckets here.)
+    if (hashTable->cuckoo) {
+        cuckooDestroy(hashTable->cuckoo);
+    }
+    //    Snapshots that were not released are released first, which frees the
+    //    entries that only they kept.
+    while (hashTable->oldest_snapshot) {
+        releaseSnapshot(hashTable->oldest_snapshot);
+    }
     for (int i = 0; i < hashTable -> num_buckets; ++i) {
         HashTableEntry *tmp = hashTable->buckets[i];
         while (tmp) {
             HashTableEntry *curr = tmp;
             tmp = tmp->next;
-            free(curr);
+            freeHashTableEntry(hashTable, curr);
         }
     }
-    // 2. Free buckets
-    free(hashTable->buckets);
-    // 3. Free hash table
-    free(hashTable);
+    // 2. Free the buckets
+    if (hashTable->buckets) {
+        htFree(hashTable, hashTable->buckets, hashTable->num_buckets * sizeof(HashTableEntry *));
+    }
+    // 3. Free hash table through a copy of the allocator, since it lives inside the table
+    HashTableAllocator allocator = hashTable->allocator;
+    allocator.free(allocator.context, hashTable, sizeof(HashTable));
 }
 
 void *insertItem(HashTable *hashTable, unsigned int key, void *value)
 {
-    // TODO: Implement
-    //1. First, we want to check if the key is present in the hash table.
-     HashTableEntry *newEntry = findItem(hashTable, key);
-    //2. If the key is present in the hash table, store new value and return old value
-    if (newEntry) {
-        void *old = newEntry -> value;
-        newEntry -> value = value;
-        return old;
-    }
-     //3. If not, create entry for new value and return NULL
-    HashTableEntry *newE = createHashTableEntry(key, value);
-    unsigned int index = hashTable -> hash(key);
-    newE->next = hashTable->buckets[index];
-    hashTable->buckets[index] = newE;
-    return NULL;
+    //1. Find the slot for the key, creating an empty one if it is not present.
+    int inserted;
+    void **slot = findOrCreateSlot(hashTable, key, &inserted);
+    //2. Store the new value and return the old one, which is NULL for a new entry.
+    void *old = *slot;
+    *slot = value;
+    return old;
+}
+
+void *upsertItem(HashTable *hashTable, unsigned int key, UpsertFunction fn, void *context)
+{
+    int inserted;
+    void **slot = findOrCreateSlot(hashTable, key, &inserted);
+    *slot = fn(key, *slot, inserted, context);
+    return *slot;
+}
+
+void **getOrInsertSlot(HashTable *hashTable, unsigned int key, int *inserted)
+{
+    int created;
+    void **slot = findOrCreateSlot(hashTable, key, &created);
+    if (inserted)
+    {
+        *inserted = created;
+    }
+    return slot;
 }
 
 void *getItem(HashTable *hashTable, unsigned int key)
@@ -225,6 +815,10 @@ void *getItem(HashTable *hashTable, unsigned int key)
  
  
     //1. First, we want to check if the key is present in the hash table.
+    //   Cuckoo tables look in the two buckets of the key instead.
+    if (hashTable->cuckoo) {
+        return cuckooGet(hashTable->cuckoo, key);
+    }
     HashTableEntry *newEntry = findItem(hashTable, key);
     //2. If the key exist, return the value
     if (newEntry) {
@@ -235,39 +829,51 @@ void *getItem(HashTable *hashTable, unsigned int key)
     //3. If not. just return NULL
 }
 
-void *removeItem(HashTable *hashTable, unsigned int key)
+/**
+ * removeEntry
+ *
+ * Shared implementation of removeItem and deleteItem.
+ *
+ * @param hashTable The pointer to the hash table.
+ * @param key The key corresponds to the hash table entry
+ * @param freeValue Whether the value is freed along with the entry
+ * @return the value of the removed entry, or NULL if the key is not present
+ */
+static void *removeEntry(HashTable *hashTable, unsigned int key, int freeValue)
 {
-    // 1. Get the bucket number and the head entry
-    unsigned int bucketI = hashTable -> hash(key); 
-    HashTableEntry *curr = hashTable->buckets[bucketI];
-    HashTableEntry *prev = NULL;
-
-    // 2. If the head holds the key, change the head to the next value, and return the old value
-    if (curr && curr->key == key) {
-        void *oldValue = curr->value;
-        hashTable->buckets[bucketI] = curr->next;
-        free(curr);
+    // 0. Cuckoo tables hold no snapshots, so the value can go right away
+    if (hashTable->cuckoo) {
+        int found;
+        void *oldValue = cuckooRemove(hashTable->cuckoo, key, &found);
+        if (freeValue) {
+            free(oldValue);
+        }
         return oldValue;
     }
-    
-    // 3. If not the head, search for the key to be removed 
-    while (curr && curr->key != key) {
-        prev = curr;
-        curr = curr->next;
+
+    // 1. Get the bucket number and the link to the head entry
+    unsigned int bucketI = hashTable -> hash(key);
+    HashTableEntry **link = &hashTable->buckets[bucketI];
+
+    // 2. Search for the key to be removed
+    while (*link) {
+        HashTableEntry *curr = *link;
+        // 3. Detach the entry and return the old value
+        if (curr->key == key && curr->died == ENTRY_ALIVE) {
+            void *oldValue = curr->value;
+            detachEntry(hashTable, link, freeValue);
+            return oldValue;
+        }
+        link = &curr->next;
     }
 
     // 4. If the key is not present in the list, return NULL
-    if (!curr) {
-        return NULL;
-    }
+    return NULL;
+}
 
-    // 5. Unlink node from the list, free, and return old value
-    if (prev) {
-        prev->next = curr->next;
-    }
-    void *oldValue = curr->value;
-    free(curr);
-    return oldValue;
+void *removeItem(HashTable *hashTable, unsigned int key)
+{
+    return removeEntry(hashTable, key, 0);
 }
 
 void deleteItem(HashTable *hashTable, unsigned int key)
@@ -280,10 +886,256 @@ void deleteItem(HashTable *hashTable, unsigned int key)
     // based on the key, and then free its return value to DELETE it from the hash table
     // You're basically clearing the memory
  
-    //1. Remove the entry and free the returned data
-    void *d = removeItem(hashTable, key);
-    if (d)
+    //1. Remove the entry and free the returned data. If a snapshot still sees
+    //   the entry, the data is freed later along with the entry itself.
+    removeEntry(hashTable, key, 1);
+}
+
+unsigned int removeIf(HashTable *hashTable, RemovePredicate predicate, void *context,
+                      RemoveCallback onRemoved)
+{
+    if (hashTable->cuckoo)
+    {
+        return cuckooRemoveIf(hashTable->cuckoo, predicate, context, onRemoved);
+    }
+
+    // 1. Walk every chain once, moving matching entries onto a private list.
+    //    Nothing is freed or reported yet, so predicate sees a stable table.
+    //    Entries a snapshot still sees stay in their chain; with a callback
+    //    their items are copied out to be reported along with the others.
+    HashTableEntry *removedList = NULL;
+    RemovedItem *kept = NULL;
+    unsigned int numKept = 0;
+    unsigned int keptCapacity = 0;
+    unsigned int removed = 0;
+    unsigned int i;
+    for (i = 0; i < hashTable->num_buckets; ++i)
+    {
+        HashTableEntry **link = &hashTable->buckets[i];
+        while (*link)
+        {
+            HashTableEntry *curr = *link;
+            if (curr->died != ENTRY_ALIVE || !predicate(curr->key, curr->value, context))
+            {
+                link = &curr->next;
+                continue;
+            }
+
+            ++removed;
+            if (isShared(hashTable, curr))
+            {
+                // 2. A snapshot still sees the entry: keep it in its chain.
+                //    Without a callback it frees the value once no snapshot
+                //    sees it any more, like deleteItem.
+                retireEntry(hashTable, curr);
+                curr->owns_value = !onRemoved;
+                link = &curr->next;
+                if (onRemoved)
+                {
+                    if (numKept == keptCapacity)
+                    {
+                        keptCapacity = keptCapacity ? 2 * keptCapacity : 16;
+                        RemovedItem *grown = (RemovedItem *)checkedAlloc(NULL, keptCapacity * sizeof(RemovedItem));
+                        unsigned int j;
+                        for (j = 0; j < numKept; ++j)
+                        {
+                            grown[j] = kept[j];
+                        }
+                        free(kept);
+                        kept = grown;
+                    }
+                    kept[numKept].key = curr->key;
+                    kept[numKept].value = curr->value;
+                    ++numKept;
+                }
+                continue;
+            }
+
+            // Only look for older copies when a snapshot could still see one,
+            // so a table without snapshots keeps a single pass per chain. The
+            // callback owns every value it is given, so it needs no copy.
+            HashTableEntry *copy = (!onRemoved && hashTable->newest_snapshot) ? findSharedCopy(hashTable, curr) : NULL;
+            *link = curr->next;
+            if (copy)
+            {
+                //    A snapshot still sees the value through an older copy of
+                //    the entry, so the copy frees it instead.
+                copy->owns_value = 1;
+                htFree(hashTable, curr, sizeof(HashTableEntry));
+            }
+            else
+            {
+                curr->next = removedList;
+                removedList = curr;
+            }
+        }
+    }
+
+    // 3. Report the items of the entries kept for snapshots.
+    for (i = 0; i < numKept; ++i)
+    {
+        onRemoved(kept[i].key, kept[i].value, context);
+    }
+    free(kept);
+
+    // 4. Report and free the other removed entries in one batch.
+    while (removedList)
+    {
+        HashTableEntry *curr = removedList;
+        removedList = curr->next;
+        if (onRemoved)
+        {
+            onRemoved(curr->key, curr->value, context);
+        }
+        else
+        {
+            free(curr->value);
+        }
+        htFree(hashTable, curr, sizeof(HashTableEntry));
+    }
+    return removed;
+}
+
+unsigned int removeItems(HashTable *hashTable, const unsigned int *keys, unsigned int numKeys,
+                         void **removedValues)
+{
+    return bulkRemove(hashTable, keys, numKeys, removedValues, 0);
+}
+
+unsigned int deleteItems(HashTable *hashTable, const unsigned int *keys, unsigned int numKeys)
+{
+    return bulkRemove(hashTable, keys, numKeys, NULL, 1);
+}
+
+/**
+ * scanVersion
+ *
+ * Shared implementation of scanHashTable and scanSnapshot, which visits the
+ * entries that are part of the table as seen at the given version.
+ */
+static unsigned int scanVersion(HashTable *hashTable, unsigned int version, unsigned int cursor,
+                                unsigned int maxItems, ScanCallback callback, void *context)
+{
+    // The bucket count is fixed and entries never move between buckets, so the
+    // cursor is simply the next bucket index and a full pass sees every entry
+    // that stays in the table exactly once.
+    if (maxItems == 0)
     {
-        free(d);
+        maxItems = 1;
     }
-}
\ No newline at end of file
+    unsigned long long bucketBudget = 10ULL * maxItems;
+    unsigned int visited = 0;
+
+    while (cursor < hashTable->num_buckets && visited < maxItems && bucketBudget--)
+    {
+        HashTableEntry *curr = hashTable->buckets[cursor++];
+        while (curr)
+        {
+            // Read next first, since the callback may remove curr.
+            HashTableEntry *next = curr->next;
+            if (isVisible(curr, version))
+            {
+                callback(curr->key, curr->value, context);
+                ++visited;
+            }
+            curr = next;
+        }
+    }
+    return cursor < hashTable->num_buckets ? cursor : 0;
+}
+
+unsigned int scanHashTable(HashTable *hashTable, unsigned int cursor, unsigned int maxItems,
+                           ScanCallback callback, void *context)
+{
+    if (hashTable->cuckoo)
+    {
+        return cuckooScan(hashTable->cuckoo, cursor, maxItems, callback, context);
+    }
+    return scanVersion(hashTable, LIVE_VIEW, cursor, maxItems, callback, context);
+}
+
+HashTableSnapshot *snapshotHashTable(HashTable *hashTable)
+{
+    // Cuckoo inserts move items between buckets in place, so there is no
+    // entry to keep around for a snapshot.
+    if (hashTable->cuckoo)
+    {
+        return NULL;
+    }
+
+    // The snapshot sees everything written so far. Bumping the version makes
+    // every later write distinguishable from what the snapshot sees.
+    HashTableSnapshot *snapshot = (HashTableSnapshot *)htAlloc(hashTable, sizeof(HashTableSnapshot));
+    snapshot->table = hashTable;
+    snapshot->version = hashTable->version++;
+    snapshot->newer = NULL;
+    snapshot->retired = NULL;
+    snapshot->older = hashTable->newest_snapshot;
+    if (hashTable->newest_snapshot)
+    {
+        hashTable->newest_snapshot->newer = snapshot;
+    }
+    else
+    {
+        hashTable->oldest_snapshot = snapshot;
+    }
+    hashTable->newest_snapshot = snapshot;
+    return snapshot;
+}
+
+void *getSnapshotItem(HashTableSnapshot *snapshot, unsigned int key)
+{
+    HashTableEntry *entry = findVisibleItem(snapshot->table, key, snapshot->version);
+    return entry ? entry->value : NULL;
+}
+
+unsigned int scanSnapshot(HashTableSnapshot *snapshot, unsigned int cursor, unsigned int maxItems,
+                          ScanCallback callback, void *context)
+{
+    return scanVersion(snapshot->table, snapshot->version, cursor, maxItems, callback, context);
+}
+
+void releaseSnapshot(HashTableSnapshot *snapshot)
+{
+    HashTable *hashTable = snapshot->table;
+    if (snapshot->older)
+    {
+        snapshot->older->newer = snapshot->newer;
+    }
+    else
+    {
+        hashTable->oldest_snapshot = snapshot->newer;
+    }
+    if (snapshot->newer)
+    {
+        snapshot->newer->older = snapshot->older;
+    }
+    else
+    {
+        hashTable->newest_snapshot = snapshot->older;
+    }
+
+    // Only the entries retired while this was the newest snapshot can be freed:
+    // any other entry it sees was retired after a newer snapshot was taken, and
+    // that snapshot sees it too. An entry on the list is freed unless the next
+    // older snapshot was taken at or after its birth, in which case it moves to
+    // that snapshot's list, which now covers the same span of versions.
+    HashTableSnapshot *older = snapshot->older;
+    HashTableEntry *entry = snapshot->retired;
+    while (entry)
+    {
+        HashTableEntry *next = entry->next_retired;
+        if (older && entry->born <= older->version)
+        {
+            entry->next_retired = older->retired;
+            older->retired = entry;
+        }
+        else
+        {
+            unlinkEntry(hashTable, entry);
+            freeHashTableEntry(hashTable, entry);
+        }
+        entry = next;
+    }
+    htFree(hashTable, snapshot, sizeof(HashTableSnapshot));
+}
@@ -20,6 +20,8 @@
 #ifndef HASHTABLE_H
 #define HASHTABLE_H
 
+#include <stddef.h> // For size_t
+
 /****************************************************************************
  * Forward Declarations
  *
@@ -57,6 +59,66 @@ typedef struct _HashTable HashTable;
  */
 typedef struct _HashTableEntry HashTableEntry;
 
+/**
+ * This defines a type that is a _HashTableSnapshot struct. The definition for
+ * _HashTableSnapshot is implemented in hash_table.c.
+ *
+ * A snapshot is a read-only view of a hash table as it was when the snapshot
+ * was taken, see snapshotHashTable.
+ */
+typedef struct _HashTableSnapshot HashTableSnapshot;
+
+/**
+ * This defines a type that is a pointer to a function which decides whether
+ * the entry with the given key and value should be removed by removeIf. It
+ * returns non-zero to remove the entry. context is passed through from removeIf.
+ */
+typedef int (*RemovePredicate)(unsigned int key, void* value, void* context);
+
+/**
+ * This defines a type that is a pointer to a function which is called once for
+ * every entry that removeIf removed, after its pass over the table is done.
+ */
+typedef void (*RemoveCallback)(unsigned int key, void* value, void* context);
+
+/**
+ * This defines a type that is a pointer to a function which is called for
+ * every item visited by scanHashTable. context is passed through from the scan.
+ */
+typedef void (*ScanCallback)(unsigned int key, void* value, void* context);
+
+/**
+ * This defines a type that is a pointer to a function which computes the new
+ * value for a key in upsertItem. value is the current value, or NULL when
+ * inserted is non-zero because the key was not present yet. The returned value
+ * is stored in the table. context is passed through from upsertItem.
+ */
+typedef void* (*UpsertFunction)(unsigned int key, void* value, int inserted, void* context);
+
+/**
+ * This structure is the allocator vtable that a hash table uses for all of its
+ * own memory: the HashTable struct, the bucket array, every HashTableEntry and
+ * every snapshot handle. The values that users store in the table are not
+ * allocated through it, and neither are the temporary buffers that bulk
+ * removals need while they run; those come from malloc and free.
+ *
+ * alloc returns a block of at least size bytes (or NULL on failure), and free
+ * releases a block previously returned by alloc with the same size. context is
+ * passed through untouched to both functions. Like a table with no buckets, a
+ * failed allocation prints a message and exits.
+ */
+typedef struct _HashTableAllocator
+{
+    /** Allocates size bytes */
+    void *(*alloc)(void *context, size_t size);
+
+    /** Releases a block of size bytes returned by alloc */
+    void (*free)(void *context, void *ptr, size_t size);
+
+    /** User state handed to alloc and free */
+    void *context;
+} HashTableAllocator;
+
 /**
  * createHashTable
  *
@@ -71,6 +133,43 @@ typedef struct _HashTableEntry HashTableEntry;
  */
 HashTable* createHashTable(HashFunction myHashFunc, unsigned int numBuckets);
 
+/**
+ * createHashTableWithAllocator
+ *
+ * Same as createHashTable, but the memory the hash table keeps goes through the
+ * given allocator instead of malloc and free (see HashTableAllocator). The allocator is
+ * copied into the table, but anything its context points to must stay alive
+ * until the table is destroyed.
+ *
+ * @param myHashFunc The pointer to the custom hash function.
+ * @param numBuckets The number of buckets available in the hash table.
+ * @param allocator The allocator to use, or NULL for malloc and free.
+ * @return a pointer to the new hash table
+ */
+HashTable* createHashTableWithAllocator(HashFunction myHashFunc, unsigned int numBuckets,
+                                        const HashTableAllocator* allocator);
+
+/**
+ * createCuckooHashTable
+ *
+ * Creates a hash table that uses bucketized cuckoo hashing instead of chaining.
+ * Every key can only live in one of two buckets of four slots each, and every
+ * bucket fills one cache line, so getItem touches at most two cache lines no
+ * matter how full the table is. Inserting into two full buckets moves other
+ * items to their alternate bucket, and the table doubles when that fails,
+ * which keeps it more than 90% full before it grows.
+ *
+ * The table picks its buckets with its own pair of hash functions, since it
+ * needs two independent ones and rehashes when it grows. All functions in this
+ * header work on it, except snapshotHashTable.
+ *
+ * @param numBuckets The initial number of four-slot buckets, rounded up to a
+ *                   power of two.
+ * @param allocator The allocator to use, or NULL for malloc and free.
+ * @return a pointer to the new hash table
+ */
+HashTable* createCuckooHashTable(unsigned int numBuckets, const HashTableAllocator* allocator);
+
 /**
  * destroyHashTable
  *
@@ -80,6 +179,9 @@ HashTable* createHashTable(HashFunction myHashFunc, unsigned int numBuckets);
  * on heap that is associated with heap, including the values that users store in
  * the hash table.
  *
+ * Snapshots of the table that were not released yet are released as well, and
+ * must not be used afterwards.
+ *
  * @param myHashTable The pointer to the hash table.
  *
  */
@@ -98,6 +200,42 @@ void destroyHashTable(HashTable* myHashTable);
  */
 void* insertItem(HashTable* myHashTable, unsigned int key, void* value);
 
+/**
+ * upsertItem
+ *
+ * Update the value for a key in place, inserting the key if it is not present.
+ * The key is hashed once and its chain walked once, whereas getItem followed by
+ * insertItem does both twice.
+ *
+ * @param myHashTable The pointer to the hash table.
+ * @param key The key that corresponds to the value.
+ * @param fn Computes the value to store from the current one.
+ * @param context Passed through to fn.
+ * @return the value now stored for the key, as returned by fn
+ */
+void* upsertItem(HashTable* myHashTable, unsigned int key, UpsertFunction fn, void* context);
+
+/**
+ * getOrInsertSlot
+ *
+ * Get the slot that holds the value for a key, inserting the key with a NULL
+ * value if it is not present. The value can then be read and written through
+ * the slot directly. The key is hashed once and its chain walked once.
+ *
+ * The slot stays valid until the key is removed, a snapshot of the table is
+ * taken, or the table is destroyed. Once a snapshot shares the entry, the next
+ * write to the key copies it, so a slot obtained before snapshotHashTable would
+ * write into the snapshot or into the retired copy; call getOrInsertSlot again
+ * instead. In a table made by createCuckooHashTable the slot only stays valid
+ * until the next insert, which may move items between buckets.
+ *
+ * @param myHashTable The pointer to the hash table.
+ * @param key The key that corresponds to the value.
+ * @param inserted If not NULL, set to 1 if the key was inserted and 0 otherwise.
+ * @return a pointer to the value slot of the key
+ */
+void** getOrInsertSlot(HashTable* myHashTable, unsigned int key, int* inserted);
+
 /**
  * getItem
  *
@@ -115,6 +253,9 @@ void* getItem(HashTable* myHashTable, unsigned int key);
  * Remove the item in hash table based on the key and return the value stored in it.
  * In other words, return the value and free the hash table entry from heap.
  *
+ * If a live snapshot still sees the value, the caller must keep it alive until
+ * that snapshot is released. The same holds for values replaced by insertItem.
+ *
  * @param myHashTable The pointer to the hash table.
  * @param key The key that corresponds to the item.
  * @return the pointer of the value corresponding to the key, or NULL if the key is not present
@@ -134,4 +275,151 @@ void* removeItem(HashTable* myHashTable, unsigned int key);
  */
 void deleteItem(HashTable* myHashTable, unsigned int key);
 
-#endif
\ No newline at end of file
+/**
+ * removeIf
+ *
+ * Remove every item for which predicate returns non-zero, in a single pass over
+ * all buckets. Matching entries are unlinked in place while walking, and are
+ * only handed to onRemoved and freed once the whole pass is done, so onRemoved
+ * may safely use the table.
+ *
+ * With onRemoved, every removed item is reported. As with removeItem, a value
+ * that a live snapshot still sees must be kept alive until that snapshot is
+ * released. Without onRemoved, the table frees such values itself once no
+ * snapshot sees them any more, as deleteItem does.
+ *
+ * @param myHashTable The pointer to the hash table.
+ * @param predicate Decides which items are removed.
+ * @param context Passed through to predicate and onRemoved.
+ * @param onRemoved Called with every removed item, or NULL to free the removed
+ *                  values as deleteItem would.
+ * @return the number of items removed
+ */
+unsigned int removeIf(HashTable* myHashTable, RemovePredicate predicate, void* context,
+                      RemoveCallback onRemoved);
+
+/**
+ * removeItems
+ *
+ * Remove the items for all of the given keys, like calling removeItem for each
+ * of them. The keys are grouped by bucket first, so every chain is walked at
+ * most once no matter how many of the keys land in it.
+ *
+ * @param myHashTable The pointer to the hash table.
+ * @param keys The keys of the items to remove.
+ * @param numKeys The number of keys.
+ * @param removedValues If not NULL, removedValues[i] is set to the value removed
+ *                      for keys[i], or NULL if the key was not present.
+ * @return the number of items removed
+ */
+unsigned int removeItems(HashTable* myHashTable, const unsigned int* keys, unsigned int numKeys,
+                         void** removedValues);
+
+/**
+ * deleteItems
+ *
+ * Delete the items for all of the given keys, like calling deleteItem for each
+ * of them, with the single walk per chain of removeItems.
+ *
+ * @param myHashTable The pointer to the hash table.
+ * @param keys The keys of the items to delete.
+ * @param numKeys The number of keys.
+ * @return the number of items deleted
+ */
+unsigned int deleteItems(HashTable* myHashTable, const unsigned int* keys, unsigned int numKeys);
+
+/**
+ * scanHashTable
+ *
+ * Visit part of the hash table and return a cursor to resume from, so a full
+ * traversal can be spread over many calls. Start with a cursor of 0 and keep
+ * passing back the returned cursor until it is 0 again.
+ *
+ * Each call visits whole buckets until at least maxItems items were reported,
+ * or 10 * maxItems buckets were examined, so sparse tables also do bounded work.
+ * The table may be modified between calls: every item that is present for the
+ * whole scan is visited exactly once, and items inserted or removed meanwhile
+ * may or may not be visited. The callback may remove the item it is given.
+ *
+ * In a table made by createCuckooHashTable the same holds, including when the
+ * table grows between calls: until every scan started on it has returned 0,
+ * inserts grow the table rather than move items between buckets. A scan that
+ * is abandoned part way therefore leaves the table growing at a lower load.
+ *
+ * @param myHashTable The pointer to the hash table.
+ * @param cursor 0 to start a scan, or the cursor returned by the previous call.
+ * @param maxItems The number of items to visit before returning (at least 1).
+ * @param callback Called with every visited item.
+ * @param context Passed through to callback.
+ * @return the cursor to resume from, or 0 when the scan is complete
+ */
+unsigned int scanHashTable(HashTable* myHashTable, unsigned int cursor, unsigned int maxItems,
+                           ScanCallback callback, void* context);
+
+/**
+ * snapshotHashTable
+ *
+ * Take a read-only snapshot of the hash table in constant time. Later writes to
+ * the table are not visible through the snapshot.
+ *
+ * Entries are shared between the table and its snapshots. A write only copies
+ * the single entry it changes, and a removal keeps the entry in its chain for as
+ * long as a snapshot still sees it, so the memory cost of a snapshot grows with
+ * the number of writes made while it is alive. Values are never copied: an
+ * object that a value points to and that is modified in place is modified for
+ * the snapshots too. deleteItem and friends defer freeing a value until no
+ * snapshot sees it any more.
+ *
+ * Taking a snapshot invalidates every slot returned by getOrInsertSlot before
+ * it. Writes made through a fresh slot are not visible through the snapshot.
+ *
+ * The table is not internally synchronized. Readers of a snapshot and writers of
+ * the table on different threads must still serialize each call, but a snapshot
+ * stays consistent across any number of calls.
+ *
+ * @param myHashTable The pointer to the hash table.
+ * @return a pointer to the new snapshot, to be released with releaseSnapshot, or
+ *         NULL for a table made by createCuckooHashTable
+ */
+HashTableSnapshot* snapshotHashTable(HashTable* myHashTable);
+
+/**
+ * getSnapshotItem
+ *
+ * Get the value that corresponded to the key when the snapshot was taken.
+ *
+ * @param snapshot The pointer to the snapshot.
+ * @param key The key that corresponds to the item.
+ * @return the value corresponding to the key, or NULL if the key was not present
+ */
+void* getSnapshotItem(HashTableSnapshot* snapshot, unsigned int key);
+
+/**
+ * scanSnapshot
+ *
+ * Like scanHashTable, but visits the items of the snapshot. Since a snapshot
+ * never changes, every item in it is visited exactly once.
+ *
+ * @param snapshot The pointer to the snapshot.
+ * @param cursor 0 to start a scan, or the cursor returned by the previous call.
+ * @param maxItems The number of items to visit before returning (at least 1).
+ * @param callback Called with every visited item.
+ * @param context Passed through to callback.
+ * @return the cursor to resume from, or 0 when the scan is complete
+ */
+unsigned int scanSnapshot(HashTableSnapshot* snapshot, unsigned int cursor, unsigned int maxItems,
+                          ScanCallback callback, void* context);
+
+/**
+ * releaseSnapshot
+ *
+ * Release a snapshot. Entries that were only kept alive for it are freed right
+ * away, along with the values that deleteItem and removeIf deferred. Only the
+ * entries removed or overwritten while it was the newest snapshot are visited,
+ * so the cost does not depend on the size of the table.
+ *
+ * @param snapshot The pointer to the snapshot.
+ */
+void releaseSnapshot(HashTableSnapshot* snapshot);
+
+#endif
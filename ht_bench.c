@@ -0,0 +1,230 @@
+// ============================================
+// Hash table benchmark
+//
+// Compares lookup latency and data-TLB misses on a large table whose buckets
+// and entries come from malloc against one backed by the huge page allocator,
+// and against the cuckoo engine, then read-modify-write throughput of getItem +
+// insertItem against upsertItem.
+//
+//   ./ht_bench [log2 number of keys]
+//
+// The cuckoo tables get one slot per key but hold 15/16 of the keys, so their
+// lookups run at a load factor just under where they would grow. The mean is
+// taken over one timed loop; the p99 and p999 come from a second pass that
+// times every lookup on its own, and so include the cost of reading the clock.
+//
+// TLB misses are read with perf_event_open. When perf events are not
+// available (e.g. in a container, or with perf_event_paranoid too high) the
+// column is reported as n/a and only the latency is shown.
+//==================================================================
+
+#define _GNU_SOURCE
+
+#include "hash_table.h"
+#include "huge_page_allocator.h"
+
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned int hashBits;
+
+// Multiplicative hash onto 2^hashBits buckets.
+static unsigned int benchHash(unsigned int key)
+{
+    return (key * 2654435761u) >> (32 - hashBits);
+}
+
+// xorshift32, so the run does not depend on the libc rand implementation.
+static unsigned int nextRandom(unsigned int *state)
+{
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static double nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Open a counter for data-TLB read misses, or return -1.
+static int openTlbCounter(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/** The most lookups that are timed one by one for the percentiles */
+#define MAX_LATENCY_SAMPLES (1u << 20)
+
+static int compareLatency(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+    return x < y ? -1 : (x > y);
+}
+
+// Fill the table with the first numKeys keys, time random lookups of them,
+// then destroy it.
+static void run(const char *name, HashTable *ht, unsigned int numKeys, const unsigned int *keys)
+{
+    for (unsigned int i = 0; i < numKeys; ++i)
+    {
+        insertItem(ht, keys[i], (void *)(uintptr_t)(keys[i] + 1));
+    }
+
+    unsigned int seed = 12345;
+    unsigned int lookups = numKeys;
+    uintptr_t checksum = 0;
+    int counter = openTlbCounter();
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    double start = nowNs();
+    for (unsigned int i = 0; i < lookups; ++i)
+    {
+        checksum += (uintptr_t)getItem(ht, keys[nextRandom(&seed) % numKeys]);
+    }
+    double elapsed = nowNs() - start;
+
+    char tlb[32] = "n/a";
+    if (counter >= 0)
+    {
+        long long misses = 0;
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) == sizeof(misses))
+        {
+            snprintf(tlb, sizeof(tlb), "%.3f", (double)misses / lookups);
+        }
+        close(counter);
+    }
+
+    // Time a second pass lookup by lookup for the tail latencies.
+    unsigned int samples = lookups < MAX_LATENCY_SAMPLES ? lookups : MAX_LATENCY_SAMPLES;
+    unsigned int *latency = (unsigned int *)malloc(samples * sizeof(unsigned int));
+    for (unsigned int i = 0; i < samples; ++i)
+    {
+        unsigned int key = keys[nextRandom(&seed) % numKeys];
+        double before = nowNs();
+        checksum += (uintptr_t)getItem(ht, key);
+        latency[i] = (unsigned int)(nowNs() - before);
+    }
+    qsort(latency, samples, sizeof(unsigned int), compareLatency);
+    unsigned int p99 = latency[(unsigned long long)samples * 99 / 100];
+    unsigned int p999 = latency[(unsigned long long)samples * 999 / 1000];
+    free(latency);
+
+    printf("%-10s %9u %10.1f %8u %8u %16s   (checksum %lx)\n", name, numKeys, elapsed / lookups,
+           p99, p999, tlb, (unsigned long)checksum);
+    destroyHashTable(ht);
+}
+
+static void *incrementValue(unsigned int key, void *value, int inserted, void *context)
+{
+    (void)key;
+    (void)inserted;
+    (void)context;
+    return (void *)((uintptr_t)value + 1);
+}
+
+// Count random keys, half of which are not in the table yet.
+static void runCounters(unsigned int numKeys, const unsigned int *keys)
+{
+    const char *names[] = {"get+insert", "upsert", "slot"};
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        HashTable *ht = createHashTable(benchHash, 1u << hashBits);
+        unsigned int seed = 777;
+        double start = nowNs();
+        for (unsigned int i = 0; i < numKeys; ++i)
+        {
+            unsigned int key = keys[nextRandom(&seed) % (numKeys / 2)];
+            if (mode == 0)
+            {
+                uintptr_t count = (uintptr_t)getItem(ht, key);
+                insertItem(ht, key, (void *)(count + 1));
+            }
+            else if (mode == 1)
+            {
+                upsertItem(ht, key, incrementValue, NULL);
+            }
+            else
+            {
+                void **slot = getOrInsertSlot(ht, key, NULL);
+                *slot = (void *)((uintptr_t)*slot + 1);
+            }
+        }
+        double elapsed = nowNs() - start;
+        printf("%-10s %12.2f Mops/s\n", names[mode], numKeys / elapsed * 1e3);
+        destroyHashTable(ht);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    hashBits = argc > 1 ? (unsigned int)atoi(argv[1]) : 22;
+    if (hashBits < 4 || hashBits > 28)
+    {
+        printf("log2 number of keys must be between 4 and 28\n");
+        return 1;
+    }
+    unsigned int numKeys = 1u << hashBits;
+
+    // Shuffled keys, so consecutive inserts do not land on neighbouring memory.
+    unsigned int *keys = (unsigned int *)malloc(numKeys * sizeof(unsigned int));
+    unsigned int seed = 42;
+    for (unsigned int i = 0; i < numKeys; ++i)
+    {
+        keys[i] = i;
+    }
+    for (unsigned int i = numKeys - 1; i > 0; --i)
+    {
+        unsigned int j = nextRandom(&seed) % (i + 1);
+        unsigned int tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+
+    // One slot per key, filled to 93.75%. Tables of this size grow at about 95%.
+    unsigned int cuckooKeys = numKeys - numKeys / 16;
+
+    printf("%u buckets or cuckoo slots, one random lookup per key\n", numKeys);
+    printf("%-10s %9s %10s %8s %8s %16s\n", "table", "keys", "mean ns", "p99 ns", "p999 ns",
+           "dTLB miss/lookup");
+
+    HashTableAllocator *hugePages = createHugePageAllocator();
+    run("malloc", createHashTable(benchHash, numKeys), numKeys, keys);
+    run("hugepage", createHashTableWithAllocator(benchHash, numKeys, hugePages), numKeys, keys);
+    run("cuckoo", createCuckooHashTable(numKeys / 4, NULL), cuckooKeys, keys);
+    run("cuckoo+hp", createCuckooHashTable(numKeys / 4, hugePages), cuckooKeys, keys);
+    destroyHugePageAllocator(hugePages);
+
+    printf("\nread-modify-write counters\n");
+    runCounters(numKeys, keys);
+
+    free(keys);
+    return 0;
+}
@@ -9,6 +9,7 @@
 // Inform the compiler that this included module is written in C instead of C++.
 extern "C" {
 	#include "hash_table.h"
+	#include "huge_page_allocator.h"
 }
 #include "gtest/gtest.h"
 
@@ -368,3 +369,823 @@ TEST(EdgeCaseTest, StressTestInsertsAndRemoves) {
 
 
 
+
+
+///////////////////
+// Allocator tests
+///////////////////
+
+// An allocator that forwards to malloc and counts the live blocks and bytes.
+struct AllocStats { long blocks; long bytes; long calls; };
+
+void* counting_alloc(void* context, size_t size)
+{
+	AllocStats* stats = (AllocStats*) context;
+	stats->blocks++;
+	stats->bytes += size;
+	stats->calls++;
+	return malloc(size);
+}
+
+void counting_free(void* context, void* ptr, size_t size)
+{
+	AllocStats* stats = (AllocStats*) context;
+	stats->blocks--;
+	stats->bytes -= size;
+	free(ptr);
+}
+
+// A hash function for tests that need short chains on many keys.
+#define WIDE_BUCKET_NUM  (1u << 16)
+unsigned int wide_hash(unsigned int key) {
+	return (key * 2654435761u) >> 16;
+}
+
+TEST(AllocatorTest, CustomAllocatorSeesEveryAllocation)
+{
+	AllocStats stats = {0, 0, 0};
+	HashTableAllocator allocator = {counting_alloc, counting_free, &stats};
+	HashTable* ht = createHashTableWithAllocator(hash, BUCKET_NUM, &allocator);
+
+	// The table struct and the bucket array.
+	EXPECT_EQ(2, stats.blocks);
+
+	HTItem* item = (HTItem*)malloc(sizeof(HTItem));
+	insertItem(ht, 0, item);
+	insertItem(ht, BUCKET_NUM, NULL);
+	EXPECT_EQ(4, stats.blocks);
+
+	EXPECT_EQ(item, removeItem(ht, 0));
+	EXPECT_EQ(3, stats.blocks);
+
+	// Every block must come back with the size it was allocated with.
+	destroyHashTable(ht);
+	EXPECT_EQ(0, stats.blocks);
+	EXPECT_EQ(0, stats.bytes);
+	free(item);
+}
+
+// An allocator that is out of memory after a given number of allocations.
+void* failing_alloc(void* context, size_t size)
+{
+	int* remaining = (int*) context;
+	return (*remaining)-- > 0 ? malloc(size) : NULL;
+}
+
+void failing_free(void* context, void* ptr, size_t size)
+{
+	(void)context;
+	(void)size;
+	free(ptr);
+}
+
+// Create a table and insert one item with only budget allocations available.
+void insert_with_budget(int budget)
+{
+	HashTableAllocator allocator = {failing_alloc, failing_free, &budget};
+	HashTable* ht = createHashTableWithAllocator(hash, BUCKET_NUM, &allocator);
+	insertItem(ht, 0, NULL);
+}
+
+TEST(AllocatorTest, FailedAllocationExits)
+{
+	// Out of memory for the table struct, the bucket array, or an entry.
+	EXPECT_EXIT(insert_with_budget(0), ::testing::ExitedWithCode(1), "");
+	EXPECT_EXIT(insert_with_budget(1), ::testing::ExitedWithCode(1), "");
+	EXPECT_EXIT(insert_with_budget(2), ::testing::ExitedWithCode(1), "");
+}
+
+TEST(AllocatorTest, HugePageAllocatorLargeTable)
+{
+	HashTableAllocator* allocator = createHugePageAllocator();
+	ASSERT_TRUE(allocator != NULL);
+
+	// Enough buckets to need a dedicated huge page mapping, and enough
+	// entries to span several shared regions.
+	const unsigned int NUM_KEYS = 200000;
+	HashTable* ht = createHashTableWithAllocator(wide_hash, WIDE_BUCKET_NUM, allocator);
+	for (unsigned int i = 0; i < NUM_KEYS; ++i) {
+		insertItem(ht, i, (void*)(uintptr_t)(i + 1));
+	}
+	for (unsigned int i = 0; i < NUM_KEYS; i += 2) {
+		EXPECT_EQ((void*)(uintptr_t)(i + 1), removeItem(ht, i));
+	}
+	// Freed nodes are recycled for new ones.
+	for (unsigned int i = 0; i < NUM_KEYS; i += 2) {
+		insertItem(ht, i, (void*)(uintptr_t)(i + 2));
+	}
+	for (unsigned int i = 0; i < NUM_KEYS; ++i) {
+		EXPECT_EQ((void*)(uintptr_t)(i + 1 + (i % 2 == 0)), getItem(ht, i));
+	}
+	destroyHashTable(ht);
+
+	HashTable* big = createHashTableWithAllocator(hash, 1u << 20, allocator);
+	EXPECT_EQ(NULL, getItem(big, 0));
+	insertItem(big, 1, NULL);
+	EXPECT_EQ(NULL, getItem(big, 1));
+	destroyHashTable(big);
+
+	destroyHugePageAllocator(allocator);
+}
+
+/////////////////////
+// Bulk remove tests
+/////////////////////
+
+// Predicate for removeIf: removes items whose key is even.
+int is_even_key(unsigned int key, void* value, void* context)
+{
+	(void)value;
+	(void)context;
+	return key % 2 == 0;
+}
+
+// Callback for removeIf: frees the value and counts the removed items.
+void count_and_free(unsigned int key, void* value, void* context)
+{
+	(void)key;
+	(*(int*)context)++;
+	free(value);
+}
+
+// Callback for removeIf: only counts the removed items.
+void count_removed(unsigned int key, void* value, void* context)
+{
+	(void)key;
+	(void)value;
+	(*(int*)context)++;
+}
+
+TEST(BulkRemoveTest, RemoveIfMatchesAcrossChains)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+
+	size_t num_items = 10;
+	HTItem* m[num_items];
+	make_items(m, num_items);
+	for (size_t i = 0; i < num_items; ++i) {
+		insertItem(ht, i, m[i]);
+	}
+
+	// Even keys sit at the head, middle and tail of the chains.
+	int removed = 0;
+	EXPECT_EQ(5u, removeIf(ht, is_even_key, &removed, count_and_free));
+	EXPECT_EQ(5, removed);
+	for (size_t i = 0; i < num_items; ++i) {
+		EXPECT_EQ(i % 2 ? m[i] : NULL, getItem(ht, i));
+	}
+
+	// With no callback the values are freed like deleteItem does.
+	insertItem(ht, 0, malloc(sizeof(HTItem)));
+	EXPECT_EQ(1u, removeIf(ht, is_even_key, NULL, NULL));
+	EXPECT_EQ(NULL, getItem(ht, 0));
+
+	destroyHashTable(ht);
+	for (size_t i = 1; i < num_items; i += 2) {
+		free(m[i]);
+	}
+}
+
+TEST(BulkRemoveTest, RemoveItemsReturnsValuesPerKey)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+
+	size_t num_items = 6;
+	HTItem* m[num_items];
+	make_items(m, num_items);
+	for (size_t i = 0; i < num_items; ++i) {
+		insertItem(ht, i, m[i]);
+	}
+
+	// Key 3 appears twice and key 42 was never inserted.
+	unsigned int keys[] = {5, 3, 0, 42, 3, 1};
+	void* values[6];
+	EXPECT_EQ(4u, removeItems(ht, keys, 6, values));
+	EXPECT_EQ(m[5], values[0]);
+	EXPECT_EQ(m[3], values[1]);
+	EXPECT_EQ(m[0], values[2]);
+	EXPECT_EQ(NULL, values[3]);
+	EXPECT_EQ(NULL, values[4]);
+	EXPECT_EQ(m[1], values[5]);
+
+	EXPECT_EQ(m[2], getItem(ht, 2));
+	EXPECT_EQ(m[4], getItem(ht, 4));
+	EXPECT_EQ(NULL, getItem(ht, 3));
+
+	// deleteItems frees the values it removes.
+	unsigned int rest[] = {2, 4, 7};
+	EXPECT_EQ(2u, deleteItems(ht, rest, 3));
+	EXPECT_EQ(NULL, getItem(ht, 2));
+	EXPECT_EQ(0u, removeItems(ht, rest, 0, NULL));
+
+	destroyHashTable(ht);
+	free(m[0]);
+	free(m[1]);
+	free(m[3]);
+	free(m[5]);
+}
+
+TEST(BulkRemoveTest, ScratchBuffersBypassTheAllocator)
+{
+	AllocStats stats = {0, 0, 0};
+	HashTableAllocator allocator = {counting_alloc, counting_free, &stats};
+	HashTable* ht = createHashTableWithAllocator(wide_hash, WIDE_BUCKET_NUM, &allocator);
+	HashTable* cuckoo = createCuckooHashTable(64, &allocator);
+
+	unsigned int keys[100];
+	for (unsigned int i = 0; i < 100; ++i) {
+		keys[i] = i;
+		insertItem(ht, i, NULL);
+		insertItem(cuckoo, i, NULL);
+	}
+
+	// Removing only frees entries; the sort buffer and the removed item list
+	// come from malloc, not from the table's allocator.
+	long calls = stats.calls;
+	EXPECT_EQ(50u, removeItems(ht, keys, 50, NULL));
+	int removed = 0;
+	EXPECT_EQ(50u, removeIf(cuckoo, is_even_key, &removed, count_removed));
+	EXPECT_EQ(calls, stats.calls);
+
+	destroyHashTable(ht);
+	destroyHashTable(cuckoo);
+	EXPECT_EQ(0, stats.blocks);
+}
+
+//////////////
+// Scan tests
+//////////////
+
+// Callback for scanHashTable: counts how often every key was visited.
+void count_visit(unsigned int key, void* value, void* context)
+{
+	(void)value;
+	((int*)context)[key]++;
+}
+
+TEST(ScanTest, EmptyTableCompletesInOneCall)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+	int visits[1] = {0};
+	EXPECT_EQ(0u, scanHashTable(ht, 0, 10, count_visit, visits));
+	EXPECT_EQ(0, visits[0]);
+	destroyHashTable(ht);
+}
+
+TEST(ScanTest, ResumedScanVisitsSurvivorsOnce)
+{
+	const unsigned int NUM_KEYS = 5000;
+	HashTable* ht = createHashTable(wide_hash, WIDE_BUCKET_NUM);
+	for (unsigned int i = 0; i < NUM_KEYS; ++i) {
+		insertItem(ht, i, NULL);
+	}
+
+	int* visits = (int*)calloc(2 * NUM_KEYS, sizeof(int));
+	unsigned int cursor = 0;
+	unsigned int calls = 0;
+	do {
+		cursor = scanHashTable(ht, cursor, 16, count_visit, visits);
+		// Mutate the table between calls.
+		removeItem(ht, calls);
+		insertItem(ht, NUM_KEYS + calls, NULL);
+		++calls;
+	} while (cursor != 0);
+
+	// The scan needed many bounded calls, and every key that was never
+	// removed was seen exactly once.
+	EXPECT_GT(calls, 100u);
+	for (unsigned int i = calls; i < NUM_KEYS; ++i) {
+		EXPECT_EQ(1, visits[i]);
+	}
+	for (unsigned int i = 0; i < 2 * NUM_KEYS; ++i) {
+		EXPECT_LE(visits[i], 1);
+	}
+
+	free(visits);
+	destroyHashTable(ht);
+}
+
+////////////////
+// Upsert tests
+////////////////
+
+// Upsert function: keeps a counter in the value pointer itself and counts
+// how many times a key was newly inserted in context.
+void* increment_counter(unsigned int key, void* value, int inserted, void* context)
+{
+	(void)key;
+	if (inserted) {
+		(*(int*)context)++;
+	}
+	return (void*)((uintptr_t)value + 1);
+}
+
+TEST(UpsertTest, UpsertCountsInPlace)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+
+	int insertions = 0;
+	for (int round = 0; round < 3; ++round) {
+		for (unsigned int key = 0; key < 5; ++key) {
+			upsertItem(ht, key, increment_counter, &insertions);
+		}
+	}
+	EXPECT_EQ((void*)4, upsertItem(ht, 2, increment_counter, &insertions));
+
+	EXPECT_EQ(5, insertions);
+	EXPECT_EQ((void*)3, getItem(ht, 0));
+	EXPECT_EQ((void*)4, getItem(ht, 2));
+
+	destroyHashTable(ht);
+}
+
+TEST(UpsertTest, GetOrInsertSlot)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+	HTItem* item = (HTItem*)malloc(sizeof(HTItem));
+
+	// A new key gets an empty slot that can be filled in directly.
+	int inserted = 0;
+	void** slot = getOrInsertSlot(ht, 7, &inserted);
+	EXPECT_EQ(1, inserted);
+	EXPECT_EQ(NULL, *slot);
+	*slot = item;
+	EXPECT_EQ(item, getItem(ht, 7));
+
+	// An existing key returns the same slot.
+	EXPECT_EQ(slot, getOrInsertSlot(ht, 7, &inserted));
+	EXPECT_EQ(0, inserted);
+	EXPECT_EQ(slot, getOrInsertSlot(ht, 7, NULL));
+
+	// insertItem still overwrites and returns the old value.
+	EXPECT_EQ(item, insertItem(ht, 7, NULL));
+	EXPECT_EQ(NULL, *slot);
+
+	free(item);
+	destroyHashTable(ht);
+}
+
+//////////////////
+// Snapshot tests
+//////////////////
+TEST(SnapshotTest, SnapshotIgnoresLaterWrites)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+
+	size_t num_items = 4;
+	HTItem* m[num_items];
+	make_items(m, num_items);
+	insertItem(ht, 0, m[0]);
+	insertItem(ht, 1, m[1]);
+	insertItem(ht, BUCKET_NUM, m[2]);
+
+	HashTableSnapshot* snap = snapshotHashTable(ht);
+
+	// Overwrite, remove and insert after the snapshot was taken.
+	EXPECT_EQ(m[0], insertItem(ht, 0, m[3]));
+	EXPECT_EQ(m[1], removeItem(ht, 1));
+	insertItem(ht, 2, m[1]);
+
+	// The live table sees the writes...
+	EXPECT_EQ(m[3], getItem(ht, 0));
+	EXPECT_EQ(NULL, getItem(ht, 1));
+	EXPECT_EQ(m[1], getItem(ht, 2));
+
+	// ...while the snapshot still sees the table as it was.
+	EXPECT_EQ(m[0], getSnapshotItem(snap, 0));
+	EXPECT_EQ(m[1], getSnapshotItem(snap, 1));
+	EXPECT_EQ(NULL, getSnapshotItem(snap, 2));
+	EXPECT_EQ(m[2], getSnapshotItem(snap, BUCKET_NUM));
+
+	int visits[BUCKET_NUM + 1] = {0};
+	EXPECT_EQ(0u, scanSnapshot(snap, 0, 100, count_visit, visits));
+	EXPECT_EQ(1, visits[0]);
+	EXPECT_EQ(1, visits[1]);
+	EXPECT_EQ(0, visits[2]);
+	EXPECT_EQ(1, visits[BUCKET_NUM]);
+
+	releaseSnapshot(snap);
+
+	// Writes after the release prune the entries only the snapshot needed.
+	EXPECT_EQ(m[3], insertItem(ht, 0, m[0]));
+	EXPECT_EQ(m[0], getItem(ht, 0));
+
+	destroyHashTable(ht);
+	for (size_t i = 0; i < num_items; ++i) {
+		free(m[i]);
+	}
+}
+
+TEST(SnapshotTest, DeferredFreesAndNestedSnapshots)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+	HTItem* item = (HTItem*)malloc(sizeof(HTItem));
+	insertItem(ht, 5, item);
+	insertItem(ht, 6, (void*)1);
+
+	HashTableSnapshot* first = snapshotHashTable(ht);
+	insertItem(ht, 6, (void*)2);
+	HashTableSnapshot* second = snapshotHashTable(ht);
+	insertItem(ht, 6, (void*)3);
+
+	// Deleting frees the item only once no snapshot sees it (checked by ASan).
+	deleteItem(ht, 5);
+	EXPECT_EQ(NULL, getItem(ht, 5));
+	EXPECT_EQ(item, getSnapshotItem(second, 5));
+
+	EXPECT_EQ((void*)1, getSnapshotItem(first, 6));
+	EXPECT_EQ((void*)2, getSnapshotItem(second, 6));
+	EXPECT_EQ((void*)3, getItem(ht, 6));
+
+	// Bulk removal keeps the entries for the snapshots too.
+	unsigned int keys[] = {6};
+	EXPECT_EQ(1u, removeItems(ht, keys, 1, NULL));
+	EXPECT_EQ((void*)2, getSnapshotItem(second, 6));
+
+	// Releasing out of order keeps the newer snapshot intact.
+	releaseSnapshot(first);
+	EXPECT_EQ((void*)2, getSnapshotItem(second, 6));
+	EXPECT_EQ(item, getSnapshotItem(second, 5));
+
+	// An unreleased snapshot is released by destroyHashTable.
+	destroyHashTable(ht);
+}
+
+TEST(SnapshotTest, RemoveIfDefersSharedValues)
+{
+	AllocStats stats = {0, 0, 0};
+	HashTableAllocator allocator = {counting_alloc, counting_free, &stats};
+	HashTable* ht = createHashTableWithAllocator(hash, BUCKET_NUM, &allocator);
+	int* values[3];
+	for (unsigned int i = 0; i < 3; ++i) {
+		values[i] = (int*)malloc(sizeof(int));
+		*values[i] = i;
+	}
+	insertItem(ht, 0, values[0]);
+	insertItem(ht, 2, values[1]);
+	HashTableSnapshot* snap = snapshotHashTable(ht);
+	insertItem(ht, 4, values[2]);
+
+	// Without a callback, only the value inserted after the snapshot is freed
+	// right away (checked by ASan).
+	EXPECT_EQ(3u, removeIf(ht, is_even_key, NULL, NULL));
+	EXPECT_EQ(NULL, getItem(ht, 0));
+	EXPECT_EQ(0, *(int*)getSnapshotItem(snap, 0));
+	EXPECT_EQ(1, *(int*)getSnapshotItem(snap, 2));
+
+	// The table, its buckets, the snapshot and the two entries it keeps.
+	EXPECT_EQ(5, stats.blocks);
+
+	// Releasing reclaims the entries and their values without another write.
+	releaseSnapshot(snap);
+	EXPECT_EQ(2, stats.blocks);
+
+	destroyHashTable(ht);
+	EXPECT_EQ(0, stats.blocks);
+}
+
+TEST(SnapshotTest, RemoveIfReportsSharedItems)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+	insertItem(ht, 0, (void*)0x1234);
+	insertItem(ht, 2, (void*)0x5678);
+	HashTableSnapshot* snap = snapshotHashTable(ht);
+	insertItem(ht, 4, (void*)0x9abc);
+
+	// Values that are not heap blocks are reported, never freed by the table,
+	// whether or not the snapshot still sees them.
+	int reported = 0;
+	EXPECT_EQ(3u, removeIf(ht, is_even_key, &reported, count_removed));
+	EXPECT_EQ(3, reported);
+	EXPECT_EQ(NULL, getItem(ht, 2));
+	EXPECT_EQ((void*)0x5678, getSnapshotItem(snap, 2));
+
+	releaseSnapshot(snap);
+	destroyHashTable(ht);
+}
+
+TEST(SnapshotTest, OlderCopiesKeepTheirValues)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+	int* first = (int*)malloc(sizeof(int));
+	int* second = (int*)malloc(sizeof(int));
+	*first = 1;
+	*second = 2;
+	insertItem(ht, 1, first);
+	insertItem(ht, 2, second);
+
+	// Writing after the snapshot copies the entries but not their values.
+	HashTableSnapshot* snap = snapshotHashTable(ht);
+	insertItem(ht, 1, first);
+	getOrInsertSlot(ht, 2, NULL);
+
+	// Neither removal may free a value the snapshot still sees (checked by
+	// ASan).
+	deleteItem(ht, 1);
+	EXPECT_EQ(1u, removeIf(ht, is_even_key, NULL, NULL));
+	EXPECT_EQ(1, *(int*)getSnapshotItem(snap, 1));
+	EXPECT_EQ(2, *(int*)getSnapshotItem(snap, 2));
+
+	// The values are freed along with the snapshot's entries.
+	releaseSnapshot(snap);
+	destroyHashTable(ht);
+}
+
+TEST(SnapshotTest, ReleaseFreesOnlyWhatItKept)
+{
+	AllocStats stats = {0, 0, 0};
+	HashTableAllocator allocator = {counting_alloc, counting_free, &stats};
+	HashTable* ht = createHashTableWithAllocator(hash, BUCKET_NUM, &allocator);
+	insertItem(ht, 1, (void*)1);
+	HashTableSnapshot* older = snapshotHashTable(ht);
+	insertItem(ht, 2, (void*)2);
+	HashTableSnapshot* newer = snapshotHashTable(ht);
+	removeItem(ht, 1);
+	removeItem(ht, 2);
+
+	// The table, its buckets, both snapshots and the two removed entries.
+	EXPECT_EQ(6, stats.blocks);
+
+	// Key 2 was only seen by the newer snapshot, key 1 is still seen by the
+	// older one.
+	releaseSnapshot(newer);
+	EXPECT_EQ(4, stats.blocks);
+	EXPECT_EQ((void*)1, getSnapshotItem(older, 1));
+	EXPECT_EQ(NULL, getSnapshotItem(older, 2));
+
+	releaseSnapshot(older);
+	EXPECT_EQ(2, stats.blocks);
+	destroyHashTable(ht);
+}
+
+TEST(SnapshotTest, RandomWritesAndReleases)
+{
+	AllocStats stats = {0, 0, 0};
+	HashTableAllocator allocator = {counting_alloc, counting_free, &stats};
+	HashTable* ht = createHashTableWithAllocator(hash, BUCKET_NUM, &allocator);
+
+	const unsigned int num_keys = 32;
+	const unsigned int num_snaps = 4;
+	uintptr_t live[num_keys] = {0};
+	uintptr_t seen[num_snaps][num_keys];
+	HashTableSnapshot* snaps[num_snaps] = {NULL};
+	unsigned int seed = 1;
+	for (unsigned int step = 1; step <= 3000; ++step) {
+		seed = seed * 1103515245u + 12345u;
+		unsigned int r = seed >> 8;
+		unsigned int key = r % num_keys;
+		unsigned int s = (r >> 5) % num_snaps;
+		switch ((r >> 7) % 8) {
+		case 0:
+			if (snaps[s]) {
+				releaseSnapshot(snaps[s]);
+			}
+			snaps[s] = snapshotHashTable(ht);
+			for (unsigned int k = 0; k < num_keys; ++k) {
+				seen[s][k] = live[k];
+			}
+			break;
+		case 1:
+			if (snaps[s]) {
+				releaseSnapshot(snaps[s]);
+				snaps[s] = NULL;
+			}
+			break;
+		case 2:
+		case 3:
+			removeItem(ht, key);
+			live[key] = 0;
+			break;
+		default:
+			insertItem(ht, key, (void*)(uintptr_t)step);
+			live[key] = step;
+			break;
+		}
+
+		for (unsigned int k = 0; k < num_keys; ++k) {
+			ASSERT_EQ((void*)live[k], getItem(ht, k));
+			for (unsigned int i = 0; i < num_snaps; ++i) {
+				if (snaps[i]) {
+					ASSERT_EQ((void*)seen[i][k], getSnapshotItem(snaps[i], k));
+				}
+			}
+		}
+	}
+
+	// Once every snapshot is gone, only the live entries are left.
+	long live_entries = 0;
+	for (unsigned int i = 0; i < num_snaps; ++i) {
+		if (snaps[i]) {
+			releaseSnapshot(snaps[i]);
+		}
+	}
+	for (unsigned int k = 0; k < num_keys; ++k) {
+		live_entries += live[k] != 0;
+	}
+	EXPECT_EQ(2 + live_entries, stats.blocks);
+	destroyHashTable(ht);
+}
+
+TEST(SnapshotTest, SnapshotInvalidatesSlots)
+{
+	HashTable* ht = createHashTable(hash, BUCKET_NUM);
+	void** slot = getOrInsertSlot(ht, 3, NULL);
+	*slot = (void*)1;
+
+	// After a snapshot the key gets a fresh slot, and writing through it
+	// leaves the snapshot alone.
+	HashTableSnapshot* snap = snapshotHashTable(ht);
+	int inserted = 1;
+	void** fresh = getOrInsertSlot(ht, 3, &inserted);
+	EXPECT_EQ(0, inserted);
+	EXPECT_NE(slot, fresh);
+	EXPECT_EQ((void*)1, *fresh);
+	*fresh = (void*)2;
+	EXPECT_EQ((void*)2, getItem(ht, 3));
+	EXPECT_EQ((void*)1, getSnapshotItem(snap, 3));
+
+	// No snapshot sees the fresh entry, so its slot stays stable.
+	EXPECT_EQ(fresh, getOrInsertSlot(ht, 3, NULL));
+	releaseSnapshot(snap);
+	EXPECT_EQ(fresh, getOrInsertSlot(ht, 3, NULL));
+
+	destroyHashTable(ht);
+}
+
+////////////////////
+// Cuckoo tests
+////////////////////
+TEST(CuckooTest, SameBehaviourAsChaining)
+{
+	HashTable* ht = createCuckooHashTable(2, NULL);
+
+	size_t num_items = 3;
+	HTItem* m[num_items];
+	make_items(m, num_items);
+
+	EXPECT_EQ(NULL, getItem(ht, 0));
+	EXPECT_EQ(NULL, insertItem(ht, 0, m[0]));
+	EXPECT_EQ(m[0], insertItem(ht, 0, m[1]));
+	EXPECT_EQ(m[1], getItem(ht, 0));
+	EXPECT_EQ(m[1], removeItem(ht, 0));
+	EXPECT_EQ(NULL, removeItem(ht, 0));
+
+	// Enough keys to force the two-bucket table to grow a few times.
+	int insertions = 0;
+	for (unsigned int key = 0; key < 100; ++key) {
+		upsertItem(ht, key, increment_counter, &insertions);
+		upsertItem(ht, key, increment_counter, &insertions);
+	}
+	EXPECT_EQ(100, insertions);
+	for (unsigned int key = 0; key < 100; ++key) {
+		EXPECT_EQ((void*)2, getItem(ht, key));
+	}
+
+	int inserted = 0;
+	void** slot = getOrInsertSlot(ht, 500, &inserted);
+	EXPECT_EQ(1, inserted);
+	*slot = m[2];
+	EXPECT_EQ(m[2], getItem(ht, 500));
+
+	int removed = 0;
+	insertItem(ht, 500, NULL);
+	EXPECT_EQ(51u, removeIf(ht, is_even_key, &removed, count_removed));
+	EXPECT_EQ(51, removed);
+	EXPECT_EQ(NULL, getItem(ht, 10));
+	EXPECT_EQ((void*)2, getItem(ht, 11));
+
+	unsigned int keys[] = {11, 12, 13};
+	void* values[3];
+	EXPECT_EQ(2u, removeItems(ht, keys, 3, values));
+	EXPECT_EQ((void*)2, values[0]);
+	EXPECT_EQ(NULL, values[1]);
+
+	insertItem(ht, 1000, m[0]);
+	deleteItem(ht, 1000);
+
+	// Snapshots are only supported by chaining tables.
+	EXPECT_EQ(NULL, snapshotHashTable(ht));
+
+	destroyHashTable(ht);
+	free(m[1]);
+	free(m[2]);
+}
+
+TEST(CuckooTest, FillsPastNinetyPercentBeforeGrowing)
+{
+	AllocStats stats = {0, 0, 0};
+	HashTableAllocator allocator = {counting_alloc, counting_free, &stats};
+
+	// 1024 buckets of 4 slots. The table only allocates again when it grows.
+	const unsigned int CAPACITY = 1024 * 4;
+	HashTable* ht = createCuckooHashTable(1024, &allocator);
+	long bytes = stats.bytes;
+
+	unsigned int key = 0;
+	while (stats.bytes == bytes) {
+		insertItem(ht, key * 7919, (void*)(uintptr_t)(key + 1));
+		++key;
+	}
+	EXPECT_GT(key - 1, CAPACITY * 9 / 10);
+
+	for (unsigned int i = 0; i < key; ++i) {
+		EXPECT_EQ((void*)(uintptr_t)(i + 1), getItem(ht, i * 7919));
+	}
+
+	destroyHashTable(ht);
+	EXPECT_EQ(0, stats.blocks);
+}
+
+TEST(CuckooTest, ScanVisitsEachItemOnceWhileInserting)
+{
+	// A table close to full, where inserts would normally move items around.
+	const unsigned int NUM_KEYS = 3800;
+	const unsigned int MAX_KEYS = 2 * NUM_KEYS;
+	HashTable* ht = createCuckooHashTable(1024, NULL);
+	for (unsigned int i = 0; i < NUM_KEYS; ++i) {
+		insertItem(ht, i, (void*)(uintptr_t)(i + 1));
+	}
+
+	static int visits[MAX_KEYS];
+	unsigned int next = NUM_KEYS;
+	unsigned int cursor = 0;
+	do {
+		cursor = scanHashTable(ht, cursor, 16, count_visit, visits);
+		for (int j = 0; j < 2 && next < MAX_KEYS; ++j, ++next) {
+			insertItem(ht, next, (void*)(uintptr_t)(next + 1));
+		}
+	} while (cursor != 0);
+
+	for (unsigned int i = 0; i < NUM_KEYS; ++i) {
+		EXPECT_EQ(1, visits[i]) << "key " << i;
+	}
+	for (unsigned int i = 0; i < next; ++i) {
+		EXPECT_EQ((void*)(uintptr_t)(i + 1), getItem(ht, i));
+	}
+
+	destroyHashTable(ht);
+}
+
+// Hands out cache-line-aligned blocks and remembers the largest request.
+void* aligned_alloc_largest(void* context, size_t size)
+{
+	size_t* largest = (size_t*) context;
+	if (size > *largest) {
+		*largest = size;
+	}
+	void* ptr = NULL;
+	return posix_memalign(&ptr, 64, size) == 0 ? ptr : NULL;
+}
+
+void aligned_free_largest(void*, void* ptr, size_t)
+{
+	free(ptr);
+}
+
+TEST(CuckooTest, AlignedBucketsAreNotPadded)
+{
+	size_t largest = 0;
+	HashTableAllocator allocator = {aligned_alloc_largest, aligned_free_largest, &largest};
+
+	// 1024 buckets of 64 bytes, with no extra cache line for alignment.
+	HashTable* ht = createCuckooHashTable(1024, &allocator);
+	EXPECT_EQ((size_t)1024 * 64, largest);
+
+	for (unsigned int i = 0; i < 100; ++i) {
+		insertItem(ht, i, (void*)(uintptr_t)(i + 1));
+	}
+	EXPECT_EQ((void*)(uintptr_t)42, getItem(ht, 41));
+
+	destroyHashTable(ht);
+}
+
+TEST(CuckooTest, ScanContinuesAcrossGrowth)
+{
+	AllocStats stats = {0, 0, 0};
+	HashTableAllocator allocator = {counting_alloc, counting_free, &stats};
+
+	// Two full buckets. The next insert cannot move anything out of the way,
+	// so it doubles the table without displacing items.
+	const unsigned int NUM_KEYS = 8;
+	HashTable* ht = createCuckooHashTable(2, &allocator);
+	for (unsigned int i = 0; i < NUM_KEYS; ++i) {
+		insertItem(ht, i, NULL);
+	}
+	long bytes = stats.bytes;
+
+	// Grow the table from under the scan after it visited the first bucket.
+	int visits[NUM_KEYS + 1] = {0};
+	unsigned int cursor = scanHashTable(ht, 0, 1, count_visit, visits);
+	EXPECT_NE(0u, cursor);
+	insertItem(ht, NUM_KEYS, NULL);
+	EXPECT_NE(bytes, stats.bytes);
+	while (cursor != 0) {
+		cursor = scanHashTable(ht, cursor, 1, count_visit, visits);
+	}
+
+	for (unsigned int i = 0; i < NUM_KEYS; ++i) {
+		EXPECT_EQ(1, visits[i]);
+	}
+
+	destroyHashTable(ht);
+}
@@ -0,0 +1,218 @@
+// ============================================
+// The huge page allocator file
+//
+// Copyright 2023 Georgia Tech. All rights reserved.
+// The materials provided by the instructor in this course are for
+// the use of the students currently enrolled in the course.
+// Copyrighted course materials may not be further disseminated.
+// This file must NOT be made publicly available anywhere.
+//==================================================================
+
+// MAP_ANONYMOUS and MADV_HUGEPAGE are not part of strict C11.
+#define _GNU_SOURCE
+
+#include "huge_page_allocator.h"
+
+#include <stdint.h>   // For uintptr_t
+#include <stdlib.h>   // For malloc and free
+#include <sys/mman.h> // For mmap, munmap and madvise
+
+/****************************************************************************
+ * Hidden Definitions
+ ***************************************************************************/
+/** Blocks up to this size are carved out of shared regions */
+#define SMALL_BLOCK_MAX 256
+
+/** Small blocks are rounded up to a multiple of this size */
+#define SMALL_BLOCK_ALIGN 16
+
+#define NUM_SIZE_CLASSES (SMALL_BLOCK_MAX / SMALL_BLOCK_ALIGN)
+
+/**
+ * A freed small block. The link is stored inside the block itself.
+ */
+typedef struct _FreeBlock
+{
+    struct _FreeBlock *next;
+} FreeBlock;
+
+/**
+ * The header at the start of every shared 2 MB region.
+ */
+typedef struct _Region
+{
+    /** The previously mapped region, or NULL */
+    struct _Region *next;
+} Region;
+
+/**
+ * The state behind a huge page allocator. The vtable comes first so the
+ * HashTableAllocator pointer handed out to users is also a pointer to this.
+ */
+typedef struct _HugePageAllocator
+{
+    /** The vtable handed to createHashTableWithAllocator */
+    HashTableAllocator vtable;
+
+    /** Every shared region, so they can be unmapped on destroy */
+    Region *regions;
+
+    /** The next unused byte in the newest region */
+    char *bump;
+
+    /** The end of the newest region */
+    char *bumpEnd;
+
+    /** One free list per small size class */
+    FreeBlock *freeLists[NUM_SIZE_CLASSES];
+} HugePageAllocator;
+
+/****************************************************************************
+ * Private Functions
+ ***************************************************************************/
+/**
+ * roundUp
+ *
+ * Round size up to a multiple of align, which must be a power of two.
+ */
+static size_t roundUp(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+/**
+ * mapHugePages
+ *
+ * Map len bytes (a multiple of HUGE_PAGE_SIZE) aligned to HUGE_PAGE_SIZE, and
+ * ask the kernel to back them with transparent huge pages. Over-allocating by
+ * one huge page and trimming both ends is what guarantees the alignment, since
+ * mmap only promises 4 KB alignment.
+ *
+ * @return the start of the mapping, or NULL if mmap failed
+ */
+static void *mapHugePages(size_t len)
+{
+    size_t mapped = len + HUGE_PAGE_SIZE;
+    char *raw = (char *)mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    char *aligned = (char *)roundUp((uintptr_t)raw, HUGE_PAGE_SIZE);
+    size_t head = aligned - raw;
+    size_t tail = mapped - head - len;
+    if (head)
+    {
+        munmap(raw, head);
+    }
+    if (tail)
+    {
+        munmap(aligned + len, tail);
+    }
+
+#ifdef MADV_HUGEPAGE
+    // Best effort: without THP support the region is simply not promoted.
+    madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+/**
+ * allocSmall
+ *
+ * Pop a block off the free list of its size class, or bump-allocate it from the
+ * newest region, mapping a fresh region when that one is exhausted.
+ */
+static void *allocSmall(HugePageAllocator *hp, size_t size)
+{
+    size_t blockSize = roundUp(size ? size : 1, SMALL_BLOCK_ALIGN);
+    FreeBlock **freeList = &hp->freeLists[blockSize / SMALL_BLOCK_ALIGN - 1];
+
+    if (*freeList)
+    {
+        FreeBlock *block = *freeList;
+        *freeList = block->next;
+        return block;
+    }
+
+    if ((size_t)(hp->bumpEnd - hp->bump) < blockSize)
+    {
+        Region *region = (Region *)mapHugePages(HUGE_PAGE_SIZE);
+        if (!region)
+        {
+            return NULL;
+        }
+        region->next = hp->regions;
+        hp->regions = region;
+        hp->bump = (char *)region + roundUp(sizeof(Region), SMALL_BLOCK_ALIGN);
+        hp->bumpEnd = (char *)region + HUGE_PAGE_SIZE;
+    }
+
+    void *block = hp->bump;
+    hp->bump += blockSize;
+    return block;
+}
+
+/**
+ * hugePageAlloc / hugePageFree
+ *
+ * The HashTableAllocator entry points.
+ */
+static void *hugePageAlloc(void *context, size_t size)
+{
+    HugePageAllocator *hp = (HugePageAllocator *)context;
+    if (size <= SMALL_BLOCK_MAX)
+    {
+        return allocSmall(hp, size);
+    }
+    return mapHugePages(roundUp(size, HUGE_PAGE_SIZE));
+}
+
+static void hugePageFree(void *context, void *ptr, size_t size)
+{
+    HugePageAllocator *hp = (HugePageAllocator *)context;
+    if (!ptr)
+    {
+        return;
+    }
+    if (size <= SMALL_BLOCK_MAX)
+    {
+        size_t blockSize = roundUp(size ? size : 1, SMALL_BLOCK_ALIGN);
+        FreeBlock *block = (FreeBlock *)ptr;
+        block->next = hp->freeLists[blockSize / SMALL_BLOCK_ALIGN - 1];
+        hp->freeLists[blockSize / SMALL_BLOCK_ALIGN - 1] = block;
+        return;
+    }
+    munmap(ptr, roundUp(size, HUGE_PAGE_SIZE));
+}
+
+/****************************************************************************
+ * Public Interface Functions
+ ****************************************************************************/
+HashTableAllocator *createHugePageAllocator(void)
+{
+    HugePageAllocator *hp = (HugePageAllocator *)calloc(1, sizeof(HugePageAllocator));
+    if (!hp)
+    {
+        return NULL;
+    }
+    hp->vtable.alloc = hugePageAlloc;
+    hp->vtable.free = hugePageFree;
+    hp->vtable.context = hp;
+    return &hp->vtable;
+}
+
+void destroyHugePageAllocator(HashTableAllocator *allocator)
+{
+    HugePageAllocator *hp = (HugePageAllocator *)allocator;
+    Region *region = hp->regions;
+    while (region)
+    {
+        Region *next = region->next;
+        munmap(region, HUGE_PAGE_SIZE);
+        region = next;
+    }
+    free(hp);
+}
@@ -0,0 +1,49 @@
+// ============================================
+// The header file for the huge page allocator.
+//
+// Copyright 2023 Georgia Tech. All rights reserved.
+// The materials provided by the instructor in this course are for
+// the use of the students currently enrolled in the course.
+// Copyrighted course materials may not be further disseminated.
+// This file must NOT be made publicly available anywhere.
+//==================================================================
+
+#ifndef HUGE_PAGE_ALLOCATOR_H
+#define HUGE_PAGE_ALLOCATOR_H
+
+#include "hash_table.h"
+
+/**
+ * The size of a transparent huge page on x86-64 Linux (2 MB).
+ */
+#define HUGE_PAGE_SIZE (2u * 1024u * 1024u)
+
+/**
+ * createHugePageAllocator
+ *
+ * Creates an allocator that backs hash table memory with 2 MB transparent huge
+ * pages. Large blocks (such as the bucket array) get their own huge-page-aligned
+ * mmap region. Small blocks (such as HashTableEntry nodes) are carved out of
+ * shared 2 MB regions and recycled through per-size free lists, so neighbouring
+ * nodes share a TLB entry instead of being scattered across 4 KB pages.
+ *
+ * Huge pages are requested with madvise(MADV_HUGEPAGE). If the kernel does not
+ * grant them the memory still works, it is just backed by regular pages.
+ *
+ * The allocator is not thread-safe, and it must outlive every hash table that
+ * was created with it.
+ *
+ * @return a pointer to the new allocator, to pass to createHashTableWithAllocator
+ */
+HashTableAllocator* createHugePageAllocator(void);
+
+/**
+ * destroyHugePageAllocator
+ *
+ * Destroy the allocator and unmap every region it still owns.
+ *
+ * @param allocator The allocator returned by createHugePageAllocator.
+ */
+void destroyHugePageAllocator(HashTableAllocator* allocator);
+
+#endif